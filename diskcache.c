@@ -0,0 +1,379 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * diskcache.c: keep decoded pixels of slow images on disk,
+ * for pho, an image viewer.
+ *
+ * Copyright 2016 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+/* A 100 megapixel PNG or a big uncompressed TIFF can take seconds to
+ * decode, every time it's shown, in every session. With -D, images
+ * that took longer than DISK_CACHE_MIN_MS to decode are written, as
+ * raw pixels, to files in a cache directory. Next time, the file is
+ * mapped and the pixbuf made straight from the mapping: nothing gets
+ * decoded, and only the pages that are actually looked at (mostly all
+ * of them, when it's scaled) come off the disk.
+ *
+ * Each file is named by the MD5 of the image's path, modification
+ * time and size, so an image that changes just gets a new entry.
+ * It holds whatever the loader produced: the full image, or one
+ * already shrunk for the screen, which will do for any window no
+ * bigger than that. A smaller decode (a thumbnail, say) never
+ * replaces a bigger one. Either way it's been mirrored back already if
+ * it needed it (imgload.c).
+ *
+ * The directory is kept under gDiskCacheBytes by deleting the files
+ * used least recently; using one touches its modification time.
+ *
+ * gDiskCacheDir and gDiskCacheBytes are only set at startup, and
+ * sTrimLock keeps two threads from tidying at once, so loads and saves
+ * can come from the workers.
+ */
+
+#include "pho.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+
+/* Where to keep them (0 for nowhere), and how much room they can take.
+ * Set with -D.
+ */
+char* gDiskCacheDir = 0;
+long gDiskCacheBytes = 2048L * 1024 * 1024;
+
+/* Anything that decodes faster than this isn't worth the disk space */
+#define DISK_CACHE_MIN_MS 1000
+
+/* 2: the pixels are mirrored back if the EXIF orientation says so */
+#define DISK_MAGIC "PHOPIX2"
+
+/* At the start of each file. 64 bytes, so the pixels are aligned. */
+typedef struct {
+    char magic[8];
+    gint32 width, height, rowstride, nChannels, hasAlpha;
+    gint32 trueWidth, trueHeight;  /* of the original */
+    gint32 orientation;            /* EXIF, as the loader saw it, or 0 */
+    char unused[24];
+} DiskHeader;
+
+typedef struct {
+    char* filename;
+    GdkPixbuf* pixbuf;
+    int trueWidth, trueHeight;
+} DiskSaveJob;
+
+/* Only one thread at a time tidies the directory */
+static GMutex sTrimLock;
+
+/* The cache file for filename as it is now, or 0 if there's no cache
+ * or no such file. Free with g_free().
+ */
+static gchar* DiskCachePath(char* filename)
+{
+    char abspath[PATH_MAX];
+    struct stat st;
+    gchar* key;
+    gchar* md5;
+    gchar* base;
+    gchar* path;
+
+    if (!gDiskCacheDir || !realpath(filename, abspath)
+        || stat(abspath, &st) != 0)
+        return 0;
+
+    key = g_strdup_printf("%s\n%ld\n%ld", abspath,
+                          (long)st.st_mtime, (long)st.st_size);
+    md5 = g_compute_checksum_for_string(G_CHECKSUM_MD5, key, -1);
+    base = g_strdup_printf("%s.pix", md5);
+    path = g_build_filename(gDiskCacheDir, base, NULL);
+    g_free(base);
+    g_free(md5);
+    g_free(key);
+    return path;
+}
+
+static void UnmapPixels(guchar* pixels, gpointer data)
+{
+    g_mapped_file_unref((GMappedFile*)data);
+}
+
+/* If there's a cached copy of filename big enough to show in geometry
+ * geom rotated by degrees (-1 if that isn't known yet; geom 0 means
+ * full size), return a new pixbuf of it, unrotated, with the size of
+ * the original in *trueWidth and *trueHeight. Otherwise return 0.
+ */
+GdkPixbuf* DiskCacheLoad(char* filename, int degrees, PhoGeometry* geom,
+                         int* trueWidth, int* trueHeight)
+{
+    gchar* path = DiskCachePath(filename);
+    GMappedFile* map;
+    DiskHeader hdr;
+    GdkPixbuf* pix;
+    gsize len;
+    int w, h;
+
+    if (!path)
+        return 0;
+
+    /* Private and writable, so nothing that changes the pixels
+     * can change the file.
+     */
+    map = g_mapped_file_new(path, TRUE, NULL);
+    if (!map) {
+        g_free(path);
+        return 0;
+    }
+    len = g_mapped_file_get_length(map);
+    if (len >= sizeof hdr)
+        memcpy(&hdr, g_mapped_file_get_contents(map), sizeof hdr);
+
+    if (len < sizeof hdr || memcmp(hdr.magic, DISK_MAGIC, sizeof hdr.magic)
+        || hdr.width < 1 || hdr.height < 1
+        || hdr.nChannels != (hdr.hasAlpha ? 4 : 3)
+        || hdr.rowstride < hdr.width * hdr.nChannels
+        || len != sizeof hdr + (gsize)hdr.rowstride * hdr.height) {
+        if (gDebug)
+            printf("Removing bad disk cache file %s\n", path);
+        g_mapped_file_unref(map);
+        g_unlink(path);
+        g_free(path);
+        return 0;
+    }
+
+    /* Only use it if it's at least as big as the loader would make it */
+    CalcLoadSize(hdr.trueWidth, hdr.trueHeight, degrees, geom, &w, &h);
+    if (hdr.width < w - 1 || hdr.height < h - 1) {
+        g_mapped_file_unref(map);
+        g_free(path);
+        return 0;
+    }
+
+    pix = gdk_pixbuf_new_from_data(
+              (guchar*)g_mapped_file_get_contents(map) + sizeof hdr,
+              GDK_COLORSPACE_RGB, hdr.hasAlpha, 8,
+              hdr.width, hdr.height, hdr.rowstride, UnmapPixels, map);
+    if (!pix) {
+        g_mapped_file_unref(map);
+        g_free(path);
+        return 0;
+    }
+
+    /* DecodeForDisplay() looks for the orientation here */
+    if (hdr.orientation > 0) {
+        char orient[8];
+        snprintf(orient, sizeof orient, "%d", hdr.orientation);
+        gdk_pixbuf_set_option(pix, "orientation", orient);
+    }
+
+    /* Mark it recently used */
+    g_utime(path, NULL);
+
+    if (gDebug)
+        printf("Disk cache hit: %s (%dx%d)\n", filename,
+               hdr.width, hdr.height);
+    *trueWidth = hdr.trueWidth;
+    *trueHeight = hdr.trueHeight;
+    g_free(path);
+    return pix;
+}
+
+typedef struct {
+    gchar* path;
+    time_t mtime;
+    off_t size;
+} DiskFile;
+
+static gint CompareOldest(gconstpointer a, gconstpointer b)
+{
+    const DiskFile* fa = *(const DiskFile**)a;
+    const DiskFile* fb = *(const DiskFile**)b;
+
+    return (fa->mtime < fb->mtime) ? -1 : (fa->mtime > fb->mtime);
+}
+
+/* Delete the least recently used files until the directory
+ * is under gDiskCacheBytes.
+ */
+static void TrimDiskCache()
+{
+    GDir* dir;
+    const gchar* name;
+    GPtrArray* files;
+    long total = 0;
+    int i;
+
+    g_mutex_lock(&sTrimLock);
+    dir = g_dir_open(gDiskCacheDir, 0, NULL);
+    if (!dir) {
+        g_mutex_unlock(&sTrimLock);
+        return;
+    }
+
+    files = g_ptr_array_new();
+    while ((name = g_dir_read_name(dir)) != 0) {
+        DiskFile* f;
+        struct stat st;
+        gchar* path;
+
+        if (!g_str_has_suffix(name, ".pix"))
+            continue;
+        path = g_build_filename(gDiskCacheDir, name, NULL);
+        if (stat(path, &st) != 0) {
+            g_free(path);
+            continue;
+        }
+        f = g_new(DiskFile, 1);
+        f->path = path;
+        f->mtime = st.st_mtime;
+        f->size = st.st_size;
+        total += st.st_size;
+        g_ptr_array_add(files, f);
+    }
+    g_dir_close(dir);
+
+    if (total > gDiskCacheBytes)
+        g_ptr_array_sort(files, CompareOldest);
+
+    for (i = 0; i < files->len; ++i) {
+        DiskFile* f = (DiskFile*)g_ptr_array_index(files, i);
+
+        if (total > gDiskCacheBytes) {
+            if (gDebug)
+                printf("Disk cache: removing %s\n", f->path);
+            if (g_unlink(f->path) == 0)
+                total -= f->size;
+        }
+        g_free(f->path);
+        g_free(f);
+    }
+    g_ptr_array_free(files, TRUE);
+    g_mutex_unlock(&sTrimLock);
+}
+
+/* Is there already an entry at path at least width x height?
+ * The grid decodes at thumbnail size, and mustn't replace a
+ * screen-sized entry that the next display of the image would use.
+ */
+static int HaveBiggerEntry(const gchar* path, int width, int height)
+{
+    DiskHeader hdr;
+    FILE* fp = fopen(path, "rb");
+    int ok;
+
+    if (!fp)
+        return 0;
+    ok = (fread(&hdr, sizeof hdr, 1, fp) == 1);
+    fclose(fp);
+    return (ok && !memcmp(hdr.magic, DISK_MAGIC, sizeof hdr.magic)
+            && hdr.width >= width && hdr.height >= height);
+}
+
+/* Write the pixels out, unless there's a bigger entry already.
+ * Runs in a worker thread.
+ */
+static void WriteDiskEntry(gpointer data, GCancellable* cancel)
+{
+    DiskSaveJob* job = (DiskSaveJob*)data;
+    GdkPixbuf* pix = job->pixbuf;
+    const guchar* pixels = gdk_pixbuf_get_pixels(pix);
+    const gchar* orient = gdk_pixbuf_get_option(pix, "orientation");
+    gchar* path = DiskCachePath(job->filename);
+    gchar* tmppath;
+    guchar* pad;
+    DiskHeader hdr;
+    FILE* fp;
+    int rowbytes, y, ok;
+
+    if (!path || g_mkdir_with_parents(gDiskCacheDir, 0700) != 0
+        || HaveBiggerEntry(path, gdk_pixbuf_get_width(pix),
+                           gdk_pixbuf_get_height(pix))) {
+        g_free(path);
+        return;
+    }
+
+    memset(&hdr, 0, sizeof hdr);
+    memcpy(hdr.magic, DISK_MAGIC, sizeof hdr.magic);
+    hdr.width = gdk_pixbuf_get_width(pix);
+    hdr.height = gdk_pixbuf_get_height(pix);
+    hdr.rowstride = gdk_pixbuf_get_rowstride(pix);
+    hdr.nChannels = gdk_pixbuf_get_n_channels(pix);
+    hdr.hasAlpha = gdk_pixbuf_get_has_alpha(pix);
+    hdr.trueWidth = job->trueWidth;
+    hdr.trueHeight = job->trueHeight;
+    hdr.orientation = orient ? atoi(orient) : 0;
+
+    /* Write it under another name and rename it, so nobody
+     * (including another of our own threads) maps half a file.
+     */
+    tmppath = g_strdup_printf("%s.pho-%d-%p", path,
+                              (int)getpid(), (void*)g_thread_self());
+    fp = fopen(tmppath, "wb");
+    ok = (fp && fwrite(&hdr, sizeof hdr, 1, fp) == 1);
+
+    /* A pixbuf's last row stops short of the rowstride,
+     * but every row in the file is the full length.
+     */
+    rowbytes = hdr.width * hdr.nChannels;
+    pad = g_malloc0(hdr.rowstride - rowbytes + 1);
+    for (y = 0; ok && y < hdr.height; ++y)
+        ok = (fwrite(pixels + y * hdr.rowstride, 1, rowbytes, fp) == rowbytes
+              && fwrite(pad, 1, hdr.rowstride - rowbytes, fp)
+                 == hdr.rowstride - rowbytes);
+    g_free(pad);
+
+    if (fp && fclose(fp) != 0)
+        ok = 0;
+    if (ok && g_rename(tmppath, path) == 0) {
+        if (gDebug)
+            printf("Saved %s to the disk cache\n", job->filename);
+    }
+    else
+        g_unlink(tmppath);
+    g_free(tmppath);
+    g_free(path);
+
+    TrimDiskCache();
+}
+
+static void FreeDiskSaveJob(gpointer data)
+{
+    DiskSaveJob* job = (DiskSaveJob*)data;
+
+    g_object_unref(job->pixbuf);
+    g_free(job->filename);
+    free(job);
+}
+
+/* pix, the unrotated image from filename (at any size), took
+ * decodeUsec microseconds to decode: if that's slow enough, keep it
+ * on disk. trueWidth and trueHeight are the size of the original.
+ * The writing happens in the background.
+ */
+void DiskCacheSave(char* filename, GdkPixbuf* pix,
+                   int trueWidth, int trueHeight, gint64 decodeUsec)
+{
+    DiskSaveJob* job;
+
+    if (!gDiskCacheDir || !pix || decodeUsec < DISK_CACHE_MIN_MS * 1000
+        || gdk_pixbuf_get_bits_per_sample(pix) != 8
+        || (double)gdk_pixbuf_get_rowstride(pix) * gdk_pixbuf_get_height(pix)
+           > gDiskCacheBytes)
+        return;
+
+    job = calloc(1, sizeof (DiskSaveJob));
+    if (!job)
+        return;
+    job->filename = g_strdup(filename);
+    job->pixbuf = g_object_ref(pix);
+    job->trueWidth = trueWidth;
+    job->trueHeight = trueHeight;
+    if (!QueueWork(WORK_BACKGROUND, WriteDiskEntry, FreeDiskSaveJob, job))
+        FreeDiskSaveJob(job);
+}
@@ -804,8 +804,13 @@ char * OrientTab[9] = {
     "transverse",       // flipped about top-right <--> bottom-left axis
     "rotate 270",       // rotate 270 to right it.
 };
+// How far to rotate clockwise to right the image,
+// after mirroring it left to right if OrientMirror says so.
 int OrientRot[9] = {
-    0, 0, 0, 180, 180, 180, 90, 180, 270
+    0, 0, 0, 180, 180, 270, 90, 90, 270
+};
+int OrientMirror[9] = {
+    0, 0, 1, 0, 1, 1, 0, 1, 0
 };
 
 #ifdef VERBOSE
@@ -92,8 +92,10 @@ void ErrNonfatal(char * msg, int a1, int a2)
 
 //--------------------------------------------------------------------------
 // Do selected operations to one file at a time.
+// If Buf isn't NULL, it holds the contents of the file.
 //--------------------------------------------------------------------------
-void ProcessFile(const char * FileName)
+static void ProcessFileOrBuffer(const char * FileName,
+                                const uchar * Buf, unsigned int BufLen)
 {
 #ifdef APPLY_COMMAND
     int Modified = FALSE;
@@ -116,7 +118,10 @@ void ProcessFile(const char * FileName)
             ImageInfo.FileDateTime = st.st_mtime;
             ImageInfo.FileSize = st.st_size;
         }else{
-            ErrFatal("No such file");
+            // pho reads EXIF before decoding, so a missing file
+            // mustn't take the whole viewer down.
+            ErrNonfatal("No such file", 0, 0);
+            return;
         }
     }
 
@@ -130,7 +135,11 @@ void ProcessFile(const char * FileName)
         ReadMode |= READ_IMAGE;
     }
 
-    if (!ReadJpegFile(FileName, ReadMode)) return;
+    if (Buf){
+        if (!ReadJpegBuffer(Buf, BufLen, ReadMode)) return;
+    }else{
+        if (!ReadJpegFile(FileName, ReadMode)) return;
+    }
 
 #ifdef VERBOSE
     if (CheckFileSkip()){
@@ -427,3 +436,17 @@ void ProcessFile(const char * FileName)
 #endif /* VERBOSE */
 }
 
+void ProcessFile(const char * FileName)
+{
+    ProcessFileOrBuffer(FileName, NULL, 0);
+}
+
+//--------------------------------------------------------------------------
+// Same as ProcessFile, when the caller has already read the file
+// into memory, so it doesn't have to be read twice.
+//--------------------------------------------------------------------------
+void ProcessBuffer(const char * FileName, const uchar * Buf, unsigned int BufLen)
+{
+    ProcessFileOrBuffer(FileName, Buf, BufLen);
+}
+
@@ -39,6 +39,7 @@ typedef struct {
 extern char * OrientTab[];
 // Corresponding Integers.
 extern int OrientRot[];
+extern int OrientMirror[];
 
 //--------------------------------------------------------------------------
 // This structure stores Exif header image elements in a simple manner
@@ -105,6 +106,7 @@ int ReadJpegSections (FILE * infile, ReadMode_t ReadMode);
 void DiscardData(void);
 void DiscardAllButExif(void);
 int ReadJpegFile(const char * FileName, ReadMode_t ReadMode);
+int ReadJpegBuffer(const uchar * Buf, unsigned int BufLen, ReadMode_t ReadMode);
 int TrimExifFunc(void);
 int RemoveSectionType(int SectionType);
 void WriteJpegFile(const char * FileName);
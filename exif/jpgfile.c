@@ -118,18 +118,57 @@ static void process_SOFn (const uchar * Data, int marker)
 
  
 
+//--------------------------------------------------------------------------
+// Where the marker stream comes from: either a file, or a buffer
+// the caller has already read (or mapped) the file into.
+//--------------------------------------------------------------------------
+typedef struct {
+    FILE * File;
+    const uchar * Buf;
+    unsigned BufLen;
+    unsigned Pos;
+} JpegSource_t;
+
+static int SrcGetc(JpegSource_t * src)
+{
+    if (src->File) return fgetc(src->File);
+    if (src->Pos >= src->BufLen) return EOF;
+    return src->Buf[src->Pos++];
+}
+
+static int SrcRead(JpegSource_t * src, uchar * Dest, int n)
+{
+    if (src->File) return fread(Dest, 1, n, src->File);
+    if (n > (int)(src->BufLen - src->Pos)) n = src->BufLen - src->Pos;
+    memcpy(Dest, src->Buf + src->Pos, n);
+    src->Pos += n;
+    return n;
+}
+
+// How much is left after the current position.
+static int SrcRemaining(JpegSource_t * src)
+{
+    int cp, ep;
+    if (!src->File) return src->BufLen - src->Pos;
+    cp = ftell(src->File);
+    fseek(src->File, 0, SEEK_END);
+    ep = ftell(src->File);
+    fseek(src->File, cp, SEEK_SET);
+    return ep-cp;
+}
+
 //--------------------------------------------------------------------------
 // Parse the marker stream until SOS or EOI is seen;
 //--------------------------------------------------------------------------
-int ReadJpegSections (FILE * infile, ReadMode_t ReadMode)
+static int ReadSections (JpegSource_t * infile, ReadMode_t ReadMode)
 {
     int a;
     int HaveCom = FALSE;
 
-    a = fgetc(infile);
+    a = SrcGetc(infile);
 
 
-    if (a != 0xff || fgetc(infile) != M_SOI){
+    if (a != 0xff || SrcGetc(infile) != M_SOI){
         return FALSE;
     }
     for(;;){
@@ -139,11 +178,12 @@ int ReadJpegSections (FILE * infile, ReadMode_t ReadMode)
         uchar * Data;
 
         if (SectionsRead >= MAX_SECTIONS){
-            ErrFatal("Too many sections in jpg file");
+            ErrNonfatal("Too many sections in jpg file", 0, 0);
+            return FALSE;
         }
 
         for (a=0;a<7;a++){
-            marker = fgetc(infile);
+            marker = SrcGetc(infile);
             if (marker != 0xff) break;
 
             if (a >= 6){
@@ -154,19 +194,22 @@ int ReadJpegSections (FILE * infile, ReadMode_t ReadMode)
 
         if (marker == 0xff){
             // 0xff is legal padding, but if we get that many, something's wrong.
-            ErrFatal("too many padding bytes!");
+            ErrNonfatal("too many padding bytes!", 0, 0);
+            return FALSE;
         }
 
         Sections[SectionsRead].Type = marker;
   
         // Read the length of the section.
-        lh = fgetc(infile);
-        ll = fgetc(infile);
+        lh = SrcGetc(infile);
+        ll = SrcGetc(infile);
 
         itemlen = (lh << 8) | ll;
 
         if (itemlen < 2){
-            ErrFatal("invalid marker");
+            // Cut off at a segment boundary, most likely.
+            ErrNonfatal("invalid marker", 0, 0);
+            return FALSE;
         }
 
         Sections[SectionsRead].Size = itemlen;
@@ -181,31 +224,28 @@ int ReadJpegSections (FILE * infile, ReadMode_t ReadMode)
         Data[0] = (uchar)lh;
         Data[1] = (uchar)ll;
 
-        got = fread(Data+2, 1, itemlen-2, infile); // Read the whole section.
+        SectionsRead += 1;
+        got = SrcRead(infile, Data+2, itemlen-2); // Read the whole section.
         if (got != itemlen-2){
-            ErrFatal("Premature end of file?");
+            // A truncated image shouldn't take the whole viewer down.
+            ErrNonfatal("Premature end of file?", 0, 0);
+            return FALSE;
         }
-        SectionsRead += 1;
 
         switch(marker){
 
             case M_SOS:   // stop before hitting compressed data 
                 // If reading entire image is requested, read the rest of the data.
                 if (ReadMode & READ_IMAGE){
-                    int cp, ep, size;
+                    int size;
                     // Determine how much file is left.
-                    cp = ftell(infile);
-                    fseek(infile, 0, SEEK_END);
-                    ep = ftell(infile);
-                    fseek(infile, cp, SEEK_SET);
-
-                    size = ep-cp;
+                    size = SrcRemaining(infile);
                     Data = (uchar *)malloc(size);
                     if (Data == NULL){
                         ErrFatal("could not allocate data for entire image");
                     }
 
-                    got = fread(Data, 1, size, infile);
+                    got = SrcRead(infile, Data, size);
                     if (got != size){
                         ErrFatal("could not read the rest of the image");
                     }
@@ -278,6 +318,14 @@ int ReadJpegSections (FILE * infile, ReadMode_t ReadMode)
     return TRUE;
 }
 
+int ReadJpegSections (FILE * infile, ReadMode_t ReadMode)
+{
+    JpegSource_t src;
+    memset(&src, 0, sizeof(src));
+    src.File = infile;
+    return ReadSections(&src, ReadMode);
+}
+
 //--------------------------------------------------------------------------
 // Discard read data.
 //--------------------------------------------------------------------------
@@ -323,6 +371,25 @@ int ReadJpegFile(const char * FileName, ReadMode_t ReadMode)
     return ret;
 }
 
+//--------------------------------------------------------------------------
+// Same as ReadJpegFile, for a file that's already in memory.
+//--------------------------------------------------------------------------
+int ReadJpegBuffer(const uchar * Buf, unsigned int BufLen, ReadMode_t ReadMode)
+{
+    JpegSource_t src;
+    int ret;
+
+    memset(&src, 0, sizeof(src));
+    src.Buf = Buf;
+    src.BufLen = BufLen;
+    ret = ReadSections(&src, ReadMode);
+
+    if (ret == FALSE){
+        DiscardData();
+    }
+    return ret;
+}
+
 //--------------------------------------------------------------------------
 // Remove exif thumbnail
 //--------------------------------------------------------------------------
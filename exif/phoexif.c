@@ -36,9 +36,20 @@ struct ExifTypes_s ExifLabels[] =
 
 void ExifReadInfo(char* filename)
 {
+    /* Free the previous file's sections: jhead only does that itself
+     * in VERBOSE mode, and they hold ImageInfo.ThumbnailPointer.
+     */
+    DiscardData();
     ProcessFile(filename);
 }
 
+void ExifReadInfoFromData(char* filename,
+                          const unsigned char* data, unsigned int len)
+{
+    DiscardData();
+    ProcessBuffer(filename, data, len);
+}
+
 static char buf[BUFSIZ];
 
 static char* ItoS(int i)
@@ -58,6 +69,24 @@ int HasExif(void)
     return (ImageInfo.FileName[0] != '\0');
 }
 
+int ExifGetThumbnail(unsigned char** data, unsigned int* size)
+{
+    if (!HasExif() || !ImageInfo.ThumbnailPointer || !ImageInfo.ThumbnailSize)
+        return 0;
+    *data = ImageInfo.ThumbnailPointer;
+    *size = ImageInfo.ThumbnailSize;
+    return 1;
+}
+
+int ExifGetImageSize(int* width, int* height)
+{
+    if (!HasExif() || ImageInfo.Width <= 0 || ImageInfo.Height <= 0)
+        return 0;
+    *width = ImageInfo.Width;
+    *height = ImageInfo.Height;
+    return 1;
+}
+
 const char* ExifGetString(ExifFields_e field)
 {
     if (!HasExif()) {
@@ -206,3 +235,22 @@ float ExifGetFloat(ExifFields_e field)
     return 0;
 }
 
+
+int ExifOrientationRot(int orientation)
+{
+    if (orientation < 0 || orientation > 8)
+        return 0;
+    return OrientRot[orientation];
+}
+
+int ExifOrientationMirror(int orientation)
+{
+    if (orientation < 0 || orientation > 8)
+        return 0;
+    return OrientMirror[orientation];
+}
+
+int ExifGetMirror()
+{
+    return ExifOrientationMirror(ImageInfo.Orientation);
+}
@@ -52,10 +52,19 @@ typedef enum
  */
 extern void ExifReadInfo(char* filename);
 
+/*
+ * Like ExifReadInfo(), but parse the file from data, which holds
+ * its first len bytes (or all of them), instead of reading it again.
+ */
+extern void ExifReadInfoFromData(char* filename,
+                                 const unsigned char* data, unsigned int len);
+
 /*
  * Do selected operations to one file at a time.
 */
 extern void ProcessFile(const char * FileName);
+extern void ProcessBuffer(const char * FileName,
+                          const unsigned char * Buf, unsigned int BufLen);
 
 /*
  * This tells us whether we have good EXIF data
@@ -72,6 +81,30 @@ extern const char* ExifGetString(ExifFields_e field);
 extern         int ExifGetInt(ExifFields_e field);
 extern       float ExifGetFloat(ExifFields_e field);
 
+/* The JPEG thumbnail embedded in the EXIF, if any.
+ * *data points into jhead's buffers, so it's only good
+ * until the next ExifReadInfo(). Returns 0 if there's no thumbnail.
+ */
+extern int ExifGetThumbnail(unsigned char** data, unsigned int* size);
+
+/* Size of the main image, from the JPEG header. Returns 0 if unknown. */
+extern int ExifGetImageSize(int* width, int* height);
+
+/* Map an EXIF orientation tag value (1-8) to a rotation in degrees.
+ * This doesn't need ExifReadInfo() and doesn't touch the current
+ * image info, so unlike the rest of these it's safe from any thread.
+ */
+extern int ExifOrientationRot(int orientation);
+
+/* Whether an EXIF orientation tag value means the image is mirrored
+ * left to right: if so, the rotation is to be done after mirroring.
+ * Safe from any thread, like ExifOrientationRot().
+ */
+extern int ExifOrientationMirror(int orientation);
+
+/* The same for the current image */
+extern int ExifGetMirror();
+
 
 #endif /* PHOEXIF_H */
     
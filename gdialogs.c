@@ -95,6 +95,7 @@ void UpdateInfoDialog()
 {
     char buffer[256];
     char* s;
+    const char* rotation;
     int i, mask, flags;
 
     if (!gCurImage || !InfoDialog || !InfoDialog->window)
@@ -140,19 +141,23 @@ void UpdateInfoDialog()
     switch (gCurImage->curRot)
     {
       case 90:
-          gtk_label_set_text(GTK_LABEL(InfoDImgRotation), " 90 ");
+          rotation = " 90 ";
           break;
       case 180:
-          gtk_label_set_text(GTK_LABEL(InfoDImgRotation), "180");
+          rotation = "180";
           break;
       case -90:
       case 270:
-          gtk_label_set_text(GTK_LABEL(InfoDImgRotation), "-90");
+          rotation = "-90";
           break;
       default:
-          gtk_label_set_text(GTK_LABEL(InfoDImgRotation), "  0");
+          rotation = "  0";
           break;
     }
+    /* Any mirroring was done before the rotation */
+    sprintf(buffer, "%s%s", rotation,
+            gCurImage->mirrored ? ", mirrored" : "");
+    gtk_label_set_text(GTK_LABEL(InfoDImgRotation), buffer);
 
     /* Update the flags buttons */
     flags = gCurImage->noteFlags;
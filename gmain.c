@@ -119,6 +119,21 @@ void TryScale(float times)
 gint HandleGlobalKeys(GtkWidget* widget, GdkEventKey* event)
 {
     if (gDebug) printf("\nKey event\n");
+
+    /* Anything but more navigation lands wherever we were skipping to */
+    switch (event->keyval)
+    {
+      case GDK_space:
+      case GDK_Page_Down:
+      case GDK_KP_Page_Down:
+      case GDK_BackSpace:
+      case GDK_Page_Up:
+      case GDK_KP_Page_Up:
+          break;
+      default:
+          FinishSkipping();
+    }
+
     if (event->state) {
         switch (event->keyval)
         {
@@ -173,7 +188,7 @@ gint HandleGlobalKeys(GtkWidget* widget, GdkEventKey* event)
           if (gDelayMillis > 0) {
               gDelayMillis = 0;
           }
-          else if (NextImage() != 0) {
+          else if (!SkipImages(1, event->time) && NextImage() != 0) {
               if (Prompt("Quit pho?", "Quit", "Continue", "qx \n", "cn") != 0)
                   EndSession();
           }
@@ -181,7 +196,8 @@ gint HandleGlobalKeys(GtkWidget* widget, GdkEventKey* event)
       case GDK_BackSpace:
       case GDK_Page_Up:
       case GDK_KP_Page_Up:
-          PrevImage();
+          if (!SkipImages(-1, event->time))
+              PrevImage();
           return TRUE;
       case GDK_Home:
           gCurImage = 0;
@@ -262,6 +278,9 @@ gint HandleGlobalKeys(GtkWidget* widget, GdkEventKey* event)
       case GDK_k:
           ToggleKeywordsMode();
           return TRUE;
+      case GDK_c:
+          ToggleGridMode();
+          return TRUE;
       case GDK_o:
           ChangeWorkingFileSet();
           return TRUE;
@@ -364,6 +383,49 @@ static void CheckArg(char* arg)
                 printf("Slideshow delay %d milliseconds\n", gDelayMillis);
         } else if (*arg == 'r') {
             gRepeat = 1;
+        } else if (*arg == 'R') {
+            gScanRecursive = 1;
+        } else if (*arg == 'l') {
+            gLinearLight = 1;
+        } else if (*arg == 'L') {
+            gLinearLight = 0;
+        } else if (*arg == 'M') {
+            gCacheBytes = ParseByteSize(arg+1);
+            if (gCacheBytes < 0) {
+                printf("Can't parse cache size '%s'\n", arg+1);
+                Usage();
+            }
+            if (gDebug)
+                printf("Image cache size %ld bytes\n", gCacheBytes);
+            return;
+        } else if (*arg == 'Z') {
+            gPackedCacheBytes = ParseByteSize(arg+1);
+            if (gPackedCacheBytes < 0) {
+                printf("Can't parse cache size '%s'\n", arg+1);
+                Usage();
+            }
+            if (gDebug)
+                printf("Compressed cache size %ld bytes\n",
+                       gPackedCacheBytes);
+            return;
+        } else if (*arg == 'D') {
+            /* A directory, optionally with :size on the end.
+             * arg may be the PHO_ARGS string, so don't write into it.
+             */
+            char* colon = strrchr(arg+1, ':');
+            if (colon && ParseByteSize(colon+1) > 0)
+                gDiskCacheBytes = ParseByteSize(colon+1);
+            else
+                colon = arg + strlen(arg);
+            if (colon == arg+1) {
+                printf("-D needs a directory\n");
+                Usage();
+            }
+            gDiskCacheDir = g_strndup(arg+1, colon - (arg+1));
+            if (gDebug)
+                printf("Disk cache in %s, up to %ld bytes\n",
+                       gDiskCacheDir, gDiskCacheBytes);
+            return;
         } else if (*arg == 'c') {
             gCapFileFormat = strdup(arg+1);
             if (gDebug)
@@ -396,6 +458,8 @@ int main(int argc, char** argv)
             else
                 options = 0;
         }
+        else if (g_file_test(argv[1], G_FILE_TEST_IS_DIR))
+            ScanDirectory(argv[1]);
         else {
             AddImage(argv[1]);
         }
@@ -403,7 +467,7 @@ int main(int argc, char** argv)
         ++argv;
     }
 
-    if (gFirstImage == 0)
+    if (gFirstImage == 0 && !ScanInProgress())
         Usage();
 
     /* Initialize some variables associated with the notes flags */
@@ -422,10 +486,17 @@ int main(int argc, char** argv)
     gPhysMonitorWidth = gMonitorWidth = gdk_screen_width();
     gPhysMonitorHeight = gMonitorHeight = gdk_screen_height();
 
-    /* Load the first image */
-    if (NextImage() != 0)
+    StartScan();
+
+    /* Load the first image. If there isn't one yet (or none of them
+     * load), the first one from the directory scan will be shown.
+     */
+    if ((!gFirstImage || NextImage() != 0) && !ScanInProgress())
         exit(1);
 
+    /* Now weed out broken files before the user gets to them */
+    StartValidator();
+
     gtk_main();
     return 0;
 }
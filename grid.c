@@ -0,0 +1,769 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * grid.c: a contact sheet of thumbnails, for pho, an image viewer.
+ *
+ * Copyright 2016 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+/* Stepping through 3000 images one at a time is a slow way to cull
+ * them. Grid mode (PHO_DISPLAY_GRID) shows the whole list as a
+ * scrolling grid of thumbnails, in its own window. The selected cell
+ * is gCurImage, so the note keys work on it, and <return> goes back
+ * to showing it the usual way.
+ *
+ * Nothing is done for cells that aren't on the screen, so the length
+ * of the list doesn't matter. There's a pool of cells, each with a
+ * thumbnail-sized pixbuf that's allocated once; when a cell hasn't
+ * been seen for a while it gets reused for one that's scrolling in.
+ * Thumbnails come from the freedesktop.org store if they can,
+ * otherwise the worker threads decode them (and store them for
+ * next time), only for the cells on the screen. Drawing only ever
+ * copies finished cells to the window.
+ *
+ * The workers never touch a PhoImage or a cell's pixbuf: each job
+ * carries its own copy of the filename, and the cell's serial number
+ * tells both sides whether the job is still wanted. A cell that
+ * scrolls away also cancels its job, in case it's partway through
+ * a decode.
+ */
+
+#include "pho.h"
+#include "dialogs.h"
+
+#include <gdk/gdkkeysyms.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define CELL_THUMB   THUMB_NORMAL    /* biggest thumbnail in a cell */
+#define CELL_PAD     8
+#define CELL_LABEL   16              /* room for the notes under it */
+#define CELL_WIDTH   (CELL_THUMB + 2 * CELL_PAD)
+#define CELL_HEIGHT  (CELL_THUMB + 2 * CELL_PAD + CELL_LABEL)
+
+/* Keep cells for this many screenfuls, so scrolling back
+ * a little way doesn't mean making the thumbnails again.
+ */
+#define CELL_SCREENS 3
+
+#define CELL_EMPTY   0
+#define CELL_PENDING 1    /* waiting for a worker */
+#define CELL_READY   2
+#define CELL_FAILED  3
+
+typedef struct GridJob_s GridJob;
+
+typedef struct {
+    PhoImage* img;        /* 0 if the cell isn't in use */
+    int index;            /* where img was in the grid when last seen */
+    int state;
+    int serial;           /* bumped whenever the cell is reassigned */
+    int seen;             /* sLayoutSerial when it was last on the screen */
+    int rot;              /* rotation of the thumbnail from EXIF */
+    GdkPixbuf* pixbuf;    /* CELL_THUMB square, allocated once */
+    GList* link;          /* in sCellLRU */
+    GridJob* job;         /* the one making its thumbnail, if any */
+} GridCell;
+
+struct GridJob_s {
+    GridCell* cell;
+    int serial;           /* the cell's serial when the job was made */
+    char* filename;
+    int rot;
+    GdkPixbuf* result;
+    WorkJob* work;
+};
+
+static GtkWidget* sGridWin = 0;
+static GtkWidget* sGridArea = 0;
+static GtkAdjustment* sAdjustment = 0;
+static GdkGC* sEmptyGC = 0;
+
+static GdkColor sBlack = { 0, 0x0000, 0x0000, 0x0000 };
+static GdkColor sEmptyColor = { 0, 0x3000, 0x3000, 0x3000 };
+#define CELL_BACKGROUND 0x303030ff    /* same, for gdk_pixbuf_fill */
+
+/* What to go back to */
+static int sSavedDisplayMode = PHO_DISPLAY_NORMAL;
+static int sSavedDelayMillis = 0;
+
+/* The image list as an array, so any row can be found at once */
+static PhoImage** sImages = 0;
+static int sNumImages = 0;
+static int sListChanged = 1;
+static int sSelected = 0;
+
+static int sColumns = 1;
+static int sLeftMargin = 0;
+static int sLayoutSerial = 0;
+
+static GHashTable* sCells = 0;           /* PhoImage* -> GridCell* */
+static GQueue sCellLRU = { 0, 0, 0 };    /* most recently seen at the head */
+static int sMaxCells = 0;
+
+static void LeaveGridMode();    /* forward */
+
+/* Make the thumbnail for a job. Runs in a worker thread, so it only
+ * uses the job's own copy of the filename, plus the cell's serial,
+ * which it reads atomically since the main thread bumps it.
+ */
+static void MakeThumbnail(gpointer data, GCancellable* cancel)
+{
+    GridJob* job = (GridJob*)data;
+    GdkPixbuf* pix = 0;
+    GdkPixbuf* newpix;
+    int w, h;
+
+    /* Don't bother if it scrolled away while it was waiting */
+    if (g_atomic_int_get(&job->cell->serial) == job->serial) {
+        pix = ThumbnailLoad(job->filename, CELL_THUMB, &w, &h);
+
+        /* Otherwise decode it at the size of a large thumbnail,
+         * which will also store thumbnails for it.
+         */
+        if (!pix) {
+            PhoGeometry geom;
+            int rot;
+
+            geom.scaleMode = PHO_SCALE_NORMAL;
+            geom.scaleRatio = 1.;
+            geom.monitorWidth = geom.monitorHeight = THUMB_LARGE;
+            geom.screenWidth = geom.screenHeight = THUMB_LARGE;
+            pix = DecodeForDisplay(job->filename, &geom, -1, &rot, &w, &h,
+                                   cancel);
+        }
+    }
+
+    if (pix) {
+        w = gdk_pixbuf_get_width(pix);
+        h = gdk_pixbuf_get_height(pix);
+        if (w > CELL_THUMB || h > CELL_THUMB) {
+            if (w > h) {
+                h = MAX(h * CELL_THUMB / w, 1);
+                w = CELL_THUMB;
+            } else {
+                w = MAX(w * CELL_THUMB / h, 1);
+                h = CELL_THUMB;
+            }
+            /* Scaled and rotated in one pass */
+            newpix = ScaleRotatePixbuf(pix, w, h, job->rot, RESAMPLE_BEST);
+            g_object_unref(pix);
+            pix = newpix;
+        }
+        else if (job->rot != 0) {
+            newpix = RotatePixbuf(pix, job->rot);
+            g_object_unref(pix);
+            pix = newpix;
+        }
+    }
+
+    job->result = pix;
+}
+
+/* The cell doesn't want its thumbnail any more */
+static void CancelThumbnail(GridCell* cell)
+{
+    g_atomic_int_inc(&cell->serial);
+    if (cell->job) {
+        CancelWork(cell->job->work);
+        cell->job = 0;
+    }
+}
+
+/* Where cell number index is in the window */
+static void CellPosition(int index, int* x, int* y)
+{
+    *x = sLeftMargin + (index % sColumns) * CELL_WIDTH;
+    *y = (index / sColumns) * CELL_HEIGHT
+        - (int)gtk_adjustment_get_value(sAdjustment);
+}
+
+static void RedrawCell(int index)
+{
+    int x, y;
+
+    if (!sGridArea || index < 0 || index >= sNumImages)
+        return;
+    CellPosition(index, &x, &y);
+    gtk_widget_queue_draw_area(sGridArea, x, y, CELL_WIDTH, CELL_HEIGHT);
+}
+
+/* Called from the main loop when a worker has finished a job */
+static void FinishThumbnail(gpointer data)
+{
+    GridJob* job = (GridJob*)data;
+    GridCell* cell = job->cell;
+
+    if (cell->job == job)
+        cell->job = 0;
+
+    if (cell->serial == job->serial) {
+        if (job->result) {
+            int w = gdk_pixbuf_get_width(job->result);
+            int h = gdk_pixbuf_get_height(job->result);
+            int x = (CELL_THUMB - w) / 2;
+            int y = (CELL_THUMB - h) / 2;
+
+            gdk_pixbuf_fill(cell->pixbuf, CELL_BACKGROUND);
+            gdk_pixbuf_composite(job->result, cell->pixbuf, x, y, w, h,
+                                 x, y, 1., 1., GDK_INTERP_NEAREST, 255);
+            cell->state = CELL_READY;
+        }
+        else
+            cell->state = CELL_FAILED;
+        cell->rot = job->rot;
+        if (cell->seen == sLayoutSerial)
+            RedrawCell(cell->index);
+    }
+
+    if (job->result)
+        g_object_unref(job->result);
+    g_free(job->filename);
+    free(job);
+}
+
+/* How far img has been rotated from its EXIF orientation,
+ * if it's ever been shown.
+ */
+static int ExtraRotation(PhoImage* img)
+{
+    if (!img->trueWidth)
+        return 0;
+    return (img->curRot - img->exifRot + 360) % 360;
+}
+
+static void QueueThumbnail(GridCell* cell)
+{
+    GridJob* job = calloc(1, sizeof (GridJob));
+    if (!job)
+        return;
+
+    job->cell = cell;
+    job->serial = cell->serial;
+    job->filename = g_strdup(cell->img->filename);
+    job->rot = ExtraRotation(cell->img);
+    cell->state = CELL_PENDING;
+
+    /* FinishThumbnail can't run before we're back in the main loop */
+    cell->job = job;
+    job->work = QueueWork(WORK_BACKGROUND, MakeThumbnail, FinishThumbnail,
+                          job);
+    if (!job->work) {
+        cell->job = 0;
+        cell->state = CELL_EMPTY;
+        g_free(job->filename);
+        free(job);
+    }
+}
+
+/* Find a cell for img: a new one if the pool isn't full yet,
+ * otherwise the one that's gone longest without being seen.
+ */
+static GridCell* GetCell(PhoImage* img)
+{
+    GridCell* cell = 0;
+
+    if (sCellLRU.length >= sMaxCells && sCellLRU.tail) {
+        cell = (GridCell*)sCellLRU.tail->data;
+        if (cell->seen == sLayoutSerial)    /* it's on the screen */
+            cell = 0;
+    }
+
+    if (cell) {
+        if (cell->img)
+            g_hash_table_remove(sCells, cell->img);
+        CancelThumbnail(cell);
+    }
+    else {
+        cell = calloc(1, sizeof (GridCell));
+        if (!cell)
+            return 0;
+        cell->pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8,
+                                      CELL_THUMB, CELL_THUMB);
+        if (!cell->pixbuf) {
+            free(cell);
+            return 0;
+        }
+        g_queue_push_head(&sCellLRU, cell);
+        cell->link = sCellLRU.head;
+    }
+
+    cell->img = img;
+    cell->state = CELL_EMPTY;
+    g_hash_table_insert(sCells, img, cell);
+    return cell;
+}
+
+/* Work out the columns and the scrolling range for the window size */
+static void LayoutGrid()
+{
+    int width, height, rows;
+
+    if (!sGridArea || !sGridArea->window)
+        return;
+
+    gdk_drawable_get_size(sGridArea->window, &width, &height);
+    sColumns = MAX(width / CELL_WIDTH, 1);
+    sLeftMargin = MAX((width - sColumns * CELL_WIDTH) / 2, 0);
+    rows = (sNumImages + sColumns - 1) / sColumns;
+
+    /* There can be a partial row at the top and the bottom */
+    sMaxCells = MAX(sMaxCells,
+                    sColumns * (height / CELL_HEIGHT + 2) * CELL_SCREENS);
+
+    gtk_adjustment_configure(sAdjustment,
+                             CLAMP(gtk_adjustment_get_value(sAdjustment),
+                                   0, MAX(rows * CELL_HEIGHT - height, 0)),
+                             0, MAX(rows * CELL_HEIGHT, height),
+                             CELL_HEIGHT / 4,
+                             MAX(height - CELL_HEIGHT, CELL_HEIGHT),
+                             height);
+}
+
+/* Copy the image list into sImages if it's changed */
+static void RebuildList()
+{
+    PhoImage* img;
+    PhoImage** images;
+    int n = 0;
+
+    if (!sListChanged)
+        return;
+    sListChanged = 0;
+
+    if (gFirstImage) {
+        img = gFirstImage;
+        do {
+            ++n;
+            img = img->next;
+        } while (img != gFirstImage);
+    }
+
+    images = realloc(sImages, (n ? n : 1) * sizeof (PhoImage*));
+    if (!images)
+        n = 0;
+    else
+        sImages = images;
+    sNumImages = n;
+
+    sSelected = 0;
+    img = gFirstImage;
+    for (n = 0; n < sNumImages; ++n) {
+        sImages[n] = img;
+        if (img == gCurImage)
+            sSelected = n;
+        img = img->next;
+    }
+
+    LayoutGrid();
+}
+
+/* Make sure everything on the screen has a cell, and queue
+ * thumbnails for those that need them. Returns the range of
+ * cells that's visible, first to last - 1.
+ */
+static void UpdateCells(int* first, int* last)
+{
+    GridCell* cell;
+    GList* l;
+    int height, top, i;
+
+    RebuildList();
+    ++sLayoutSerial;
+
+    gdk_drawable_get_size(sGridArea->window, &i, &height);
+    top = (int)gtk_adjustment_get_value(sAdjustment);
+    *first = MIN(top / CELL_HEIGHT * sColumns, sNumImages);
+    *last = MIN((top + height + CELL_HEIGHT - 1) / CELL_HEIGHT * sColumns,
+                sNumImages);
+
+    for (i = *first; i < *last; ++i) {
+        cell = (GridCell*)g_hash_table_lookup(sCells, sImages[i]);
+        if (!cell) {
+            cell = GetCell(sImages[i]);
+            if (!cell)
+                continue;
+        }
+        cell->index = i;
+        cell->seen = sLayoutSerial;
+        g_queue_unlink(&sCellLRU, cell->link);
+        g_queue_push_head_link(&sCellLRU, cell->link);
+
+        /* If it's been rotated since, it needs doing again */
+        if (cell->state == CELL_EMPTY
+            || (cell->state == CELL_READY
+                && cell->rot != ExtraRotation(cell->img)))
+            QueueThumbnail(cell);
+    }
+
+    /* Anything still waiting that's scrolled out of sight can wait
+     * until it comes back, so the workers only work on what's shown.
+     */
+    for (l = sCellLRU.head; l; l = l->next) {
+        cell = (GridCell*)l->data;
+        if (cell->state == CELL_PENDING && cell->seen != sLayoutSerial) {
+            CancelThumbnail(cell);
+            cell->state = CELL_EMPTY;
+        }
+    }
+}
+
+/* The note flags set for img, like "1 4 12" */
+static void NoteString(PhoImage* img, char* buf, int len)
+{
+    int i, n = 0;
+
+    buf[0] = '\0';
+    for (i = 0; i < NUM_NOTES && n < len; ++i)
+        if (img->noteFlags & (1 << i))
+            n += snprintf(buf + n, len - n, "%s%d", (n ? " " : ""), i);
+}
+
+static void DrawCell(int index)
+{
+    GdkGC* gc = sGridArea->style->fg_gc[GTK_WIDGET_STATE(sGridArea)];
+    PhoImage* img = sImages[index];
+    GridCell* cell = (GridCell*)g_hash_table_lookup(sCells, img);
+    char notes[BUFSIZ];
+    int x, y;
+
+    CellPosition(index, &x, &y);
+
+    if (cell && cell->state == CELL_READY)
+        gdk_draw_pixbuf(sGridArea->window, gc, cell->pixbuf, 0, 0,
+                        x + CELL_PAD, y + CELL_PAD, CELL_THUMB, CELL_THUMB,
+                        GDK_RGB_DITHER_NONE, 0, 0);
+    else    /* not there yet, or it won't load */
+        gdk_draw_rectangle(sGridArea->window, sEmptyGC,
+                           !(cell && cell->state == CELL_FAILED),
+                           x + CELL_PAD, y + CELL_PAD,
+                           CELL_THUMB - 1, CELL_THUMB - 1);
+
+    if (index == sSelected)
+        gdk_draw_rectangle(sGridArea->window, sGridArea->style->white_gc,
+                           FALSE, x + 2, y + 2,
+                           CELL_WIDTH - 5, CELL_HEIGHT - 5);
+
+    if (img->noteFlags) {
+        PangoLayout* layout;
+
+        NoteString(img, notes, sizeof notes);
+        layout = gtk_widget_create_pango_layout(sGridArea, notes);
+        gdk_draw_layout(sGridArea->window, sGridArea->style->white_gc,
+                        x + CELL_PAD, y + CELL_PAD + CELL_THUMB + 2, layout);
+        g_object_unref(layout);
+    }
+}
+
+static gint HandleGridExpose(GtkWidget* widget, GdkEventExpose* event)
+{
+    int first, last, i;
+
+    if (!sEmptyGC) {
+        sEmptyGC = gdk_gc_new(widget->window);
+        gdk_gc_set_rgb_fg_color(sEmptyGC, &sEmptyColor);
+    }
+
+    UpdateCells(&first, &last);
+    for (i = first; i < last; ++i)
+        DrawCell(i);
+    return TRUE;
+}
+
+
+/* Scroll so the selected cell can be seen */
+static void ShowSelected()
+{
+    double top = gtk_adjustment_get_value(sAdjustment);
+    double height = gtk_adjustment_get_page_size(sAdjustment);
+    int y = sSelected / sColumns * CELL_HEIGHT;
+
+    if (y < top)
+        gtk_adjustment_set_value(sAdjustment, y);
+    else if (y + CELL_HEIGHT > top + height)
+        gtk_adjustment_set_value(sAdjustment, y + CELL_HEIGHT - height);
+}
+
+static gint HandleGridConfigure(GtkWidget* widget, GdkEventConfigure* event)
+{
+    LayoutGrid();
+    ShowSelected();
+    return FALSE;
+}
+
+static void Select(int index)
+{
+    char title[BUFSIZ];
+
+    if (sNumImages <= 0)
+        return;
+    index = CLAMP(index, 0, sNumImages - 1);
+
+    RedrawCell(sSelected);
+    sSelected = index;
+    gCurImage = sImages[index];
+    RedrawCell(sSelected);
+    ShowSelected();
+
+    snprintf(title, sizeof title, "pho: %s (%d of %d)",
+             gCurImage->filename, sSelected + 1, sNumImages);
+    gtk_window_set_title(GTK_WINDOW(sGridWin), title);
+    UpdateInfoDialog();
+}
+
+static void HandleGridScroll(GtkAdjustment* adj, gpointer data)
+{
+    gtk_widget_queue_draw(sGridArea);
+}
+
+static gint HandleGridWheel(GtkWidget* widget, GdkEventScroll* event)
+{
+    double value = gtk_adjustment_get_value(sAdjustment);
+    double maxval = gtk_adjustment_get_upper(sAdjustment)
+        - gtk_adjustment_get_page_size(sAdjustment);
+
+    if (event->direction == GDK_SCROLL_UP)
+        value -= CELL_HEIGHT / 2;
+    else if (event->direction == GDK_SCROLL_DOWN)
+        value += CELL_HEIGHT / 2;
+    gtk_adjustment_set_value(sAdjustment, CLAMP(value, 0, MAX(maxval, 0)));
+    return TRUE;
+}
+
+/* Click selects a cell, double click goes back to showing it */
+static gint HandleGridPress(GtkWidget* widget, GdkEventButton* event)
+{
+    int x, y, col, index;
+
+    RebuildList();
+    if (event->button != 1)
+        return FALSE;
+
+    x = (int)event->x - sLeftMargin;
+    y = (int)event->y + (int)gtk_adjustment_get_value(sAdjustment);
+    col = x / CELL_WIDTH;
+    if (x < 0 || col >= sColumns)
+        return TRUE;
+    index = y / CELL_HEIGHT * sColumns + col;
+    if (index >= sNumImages)
+        return TRUE;
+
+    Select(index);
+    if (event->type == GDK_2BUTTON_PRESS)
+        LeaveGridMode();
+    return TRUE;
+}
+
+static void ToggleSelectedNote(int note)
+{
+    if (sNumImages <= 0)
+        return;
+    ToggleNoteFlag(sImages[sSelected], note);
+    RedrawCell(sSelected);
+}
+
+static gint HandleGridKeys(GtkWidget* widget, GdkEventKey* event)
+{
+    int perPage;
+
+    RebuildList();
+    perPage = MAX((int)gtk_adjustment_get_page_size(sAdjustment)
+                  / CELL_HEIGHT, 1) * sColumns;
+
+    if (event->keyval >= GDK_0 && event->keyval <= GDK_9) {
+        if (event->state & GDK_CONTROL_MASK)
+            return FALSE;
+        if (event->state & GDK_MOD1_MASK)    /* alt-num: add 10 to num */
+            ToggleSelectedNote(event->keyval - GDK_0 + 10);
+        else
+            ToggleSelectedNote(event->keyval - GDK_0);
+        return TRUE;
+    }
+    if (event->state & (GDK_CONTROL_MASK | GDK_MOD1_MASK))
+        return FALSE;
+
+    switch (event->keyval)
+    {
+      case GDK_Right:
+      case GDK_KP_Right:
+          Select(sSelected + 1);
+          return TRUE;
+      case GDK_Left:
+      case GDK_KP_Left:
+          Select(sSelected - 1);
+          return TRUE;
+      case GDK_Down:
+      case GDK_KP_Down:
+          Select(sSelected + sColumns);
+          return TRUE;
+      case GDK_Up:
+      case GDK_KP_Up:
+          Select(sSelected - sColumns);
+          return TRUE;
+      case GDK_space:
+      case GDK_Page_Down:
+      case GDK_KP_Page_Down:
+          Select(sSelected + perPage);
+          return TRUE;
+      case GDK_BackSpace:
+      case GDK_Page_Up:
+      case GDK_KP_Page_Up:
+          Select(sSelected - perPage);
+          return TRUE;
+      case GDK_Home:
+      case GDK_KP_Home:
+          Select(0);
+          return TRUE;
+      case GDK_End:
+      case GDK_KP_End:
+          Select(sNumImages - 1);
+          return TRUE;
+      case GDK_Return:
+      case GDK_KP_Enter:
+      case GDK_Escape:
+      case GDK_c:
+          LeaveGridMode();
+          return TRUE;
+      case GDK_i:
+          ToggleInfo();
+          return TRUE;
+      case GDK_q:
+          EndSession();
+          return TRUE;
+      default:
+          return FALSE;
+    }
+}
+
+static gint HandleGridDelete(GtkWidget* widget, GdkEvent* event,
+                             gpointer data)
+{
+    LeaveGridMode();
+    return TRUE;
+}
+
+static void MakeGridWindow()
+{
+    GtkWidget* hbox;
+    GtkWidget* scrollbar;
+
+    sCells = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    sGridWin = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+    gtk_window_set_wmclass(GTK_WINDOW(sGridWin), "pho", "Pho");
+    gtk_window_set_default_size(GTK_WINDOW(sGridWin),
+                                gPhysMonitorWidth * 3 / 4,
+                                gPhysMonitorHeight * 3 / 4);
+    gtk_signal_connect(GTK_OBJECT(sGridWin), "delete_event",
+                       (GtkSignalFunc)HandleGridDelete, 0);
+    gtk_signal_connect(GTK_OBJECT(sGridWin), "key_press_event",
+                       (GtkSignalFunc)HandleGridKeys, 0);
+
+    hbox = gtk_hbox_new(FALSE, 0);
+    gtk_container_add(GTK_CONTAINER(sGridWin), hbox);
+
+    sGridArea = gtk_drawing_area_new();
+    gtk_widget_modify_bg(sGridArea, GTK_STATE_NORMAL, &sBlack);
+    gtk_widget_add_events(sGridArea, GDK_BUTTON_PRESS_MASK | GDK_SCROLL_MASK);
+    gtk_signal_connect(GTK_OBJECT(sGridArea), "expose_event",
+                       (GtkSignalFunc)HandleGridExpose, 0);
+    gtk_signal_connect(GTK_OBJECT(sGridArea), "configure_event",
+                       (GtkSignalFunc)HandleGridConfigure, 0);
+    gtk_signal_connect(GTK_OBJECT(sGridArea), "button_press_event",
+                       (GtkSignalFunc)HandleGridPress, 0);
+    gtk_signal_connect(GTK_OBJECT(sGridArea), "scroll_event",
+                       (GtkSignalFunc)HandleGridWheel, 0);
+    gtk_box_pack_start(GTK_BOX(hbox), sGridArea, TRUE, TRUE, 0);
+
+    sAdjustment = GTK_ADJUSTMENT(gtk_adjustment_new(0, 0, 1, 1, 1, 1));
+    gtk_signal_connect(GTK_OBJECT(sAdjustment), "value_changed",
+                       (GtkSignalFunc)HandleGridScroll, 0);
+    scrollbar = gtk_vscrollbar_new(sAdjustment);
+    gtk_box_pack_start(GTK_BOX(hbox), scrollbar, FALSE, FALSE, 0);
+
+    gtk_widget_show_all(hbox);
+}
+
+static void EnterGridMode()
+{
+    if (!gFirstImage || gDisplayMode == PHO_DISPLAY_GRID)
+        return;
+
+    if (gDisplayMode == PHO_DISPLAY_KEYWORDS)
+        HideKeywordsDialog();
+    sSavedDisplayMode = gDisplayMode;
+    gDisplayMode = PHO_DISPLAY_GRID;
+
+    /* No slideshow behind the grid's back */
+    sSavedDelayMillis = gDelayMillis;
+    gDelayMillis = 0;
+    ProgressiveStop(0);
+    if (gWin)
+        gtk_widget_hide(gWin);
+
+    if (!sGridWin)
+        MakeGridWindow();
+    gtk_widget_show(sGridWin);
+
+    sListChanged = 1;
+    RebuildList();
+    Select(sSelected);
+}
+
+/* Go back to the display mode we came from, showing the selected image */
+static void LeaveGridMode()
+{
+    if (gDisplayMode != PHO_DISPLAY_GRID)
+        return;
+
+    gDisplayMode = sSavedDisplayMode;
+    gDelayMillis = sSavedDelayMillis;
+    gtk_widget_hide(sGridWin);
+    if (gWin)
+        gtk_widget_show(gWin);
+
+    RebuildList();
+    if (!gFirstImage)
+        EndSession();
+    ThisImage();
+}
+
+void ToggleGridMode()
+{
+    if (gDisplayMode == PHO_DISPLAY_GRID)
+        LeaveGridMode();
+    else
+        EnterGridMode();
+}
+
+/* Images have been added to or removed from the list */
+void GridListChanged()
+{
+    sListChanged = 1;
+    if (sGridArea && gDisplayMode == PHO_DISPLAY_GRID)
+        gtk_widget_queue_draw(sGridArea);
+}
+
+/* img is going away: make sure no cell still refers to it. */
+void GridForget(PhoImage* img)
+{
+    GridCell* cell;
+
+    GridListChanged();
+    if (!sCells)
+        return;
+
+    cell = (GridCell*)g_hash_table_lookup(sCells, img);
+    if (!cell)
+        return;
+    g_hash_table_remove(sCells, img);
+    CancelThumbnail(cell);
+    cell->img = 0;
+    cell->state = CELL_EMPTY;
+
+    /* It's free, so it's the first to reuse */
+    g_queue_unlink(&sCellLRU, cell->link);
+    g_queue_push_tail_link(&sCellLRU, cell->link);
+}
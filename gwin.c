@@ -288,6 +288,7 @@ int SetViewModes(int dispmode, int scalemode, double scalefactor)
 void DrawImage()
 {
     int dstX = 0, dstY = 0;
+    int visX, visY, visW, visH;
     char title[BUFSIZ];
 #   define TITLELEN ((sizeof title) / (sizeof *title))
 
@@ -406,15 +407,80 @@ void DrawImage()
         }
     }
 
-    gdk_pixbuf_render_to_drawable(gImage, sDrawingArea->window,
+    /* Only draw what can actually be seen: the part of the drawing
+     * area that's on the screen. With a huge image in fullsize mode,
+     * that's a tiny fraction of it.
+     */
+    gdk_drawable_get_size(sDrawingArea->window, &visW, &visH);
+    if (gDisplayMode == PHO_DISPLAY_PRESENTATION)
+        visX = visY = 0;
+    else {
+        int originX, originY;
+        gdk_window_get_origin(sDrawingArea->window, &originX, &originY);
+        visX = MAX(0, -originX);
+        visY = MAX(0, -originY);
+        visW = MIN(visW, gdk_screen_width() - originX) - visX;
+        visH = MIN(visH, gdk_screen_height() - originY) - visY;
+    }
+
+    DrawPixbufVisible(sDrawingArea->window,
                    sDrawingArea->style->fg_gc[GTK_WIDGET_STATE(sDrawingArea)],
-                                  0, 0, dstX, dstY,
-                                  gCurImage->curWidth, gCurImage->curHeight,
-                                  GDK_RGB_DITHER_NONE, 0, 0);
+                   sDrawingArea->style->bg_gc[GTK_WIDGET_STATE(sDrawingArea)],
+                      gImage, dstX, dstY, visX, visY, visW, visH);
 
     UpdateInfoDialog(gCurImage);
 }
 
+/* While the user skips through images faster than they can be loaded,
+ * show img's name, and pix (a thumbnail, or 0) scaled to fit the window.
+ * The window keeps its size: the next real image will fix that.
+ */
+void DrawSkipping(PhoImage* img, GdkPixbuf* pix)
+{
+    char title[BUFSIZ];
+    gint width, height, w, h;
+    GdkPixbuf* scaled;
+
+    if (gWin == 0 || sDrawingArea == 0) return;
+    if (!sExposed) return;
+    if (!GTK_WIDGET_MAPPED(gWin)) return;
+
+    if (gDisplayMode != PHO_DISPLAY_PRESENTATION) {
+        if (img->fileWidth)
+            snprintf(title, sizeof title, "pho: %s (%d x %d)", img->filename,
+                     img->fileWidth, img->fileHeight);
+        else
+            snprintf(title, sizeof title, "pho: %s", img->filename);
+        gtk_window_set_title(GTK_WINDOW(gWin), title);
+    }
+
+    gdk_window_clear(sDrawingArea->window);
+    if (!pix)
+        return;
+
+    gdk_drawable_get_size(sDrawingArea->window, &width, &height);
+    w = gdk_pixbuf_get_width(pix);
+    h = gdk_pixbuf_get_height(pix);
+    if ((double)w * height > (double)h * width) {
+        h = h * width / w;
+        w = width;
+    } else {
+        w = w * height / h;
+        h = height;
+    }
+    if (w < 1 || h < 1)
+        return;
+
+    scaled = ScaleRotatePixbuf(pix, w, h, 0, RESAMPLE_FAST);
+    if (!scaled)
+        return;
+    gdk_draw_pixbuf(sDrawingArea->window,
+                    sDrawingArea->style->fg_gc[GTK_WIDGET_STATE(sDrawingArea)],
+                    scaled, 0, 0, (width - w) / 2, (height - h) / 2, w, h,
+                    GDK_RGB_DITHER_NONE, 0, 0);
+    g_object_unref(scaled);
+}
+
 static gboolean
 HandlePress(GtkWidget *widget, GdkEventButton *event)
 {
@@ -255,6 +255,7 @@ void PrintNotes()
 {
     int i;
     char *rot90=0, *rot180=0, *rot270=0, *rot0=0, *unmatchExif=0;
+    char *mirror=0;
     PhoImage *img;
     FILE *capfile = 0;
     int useGlobalCaptionFile = GlobalCaptionFile();
@@ -310,6 +311,10 @@ void PrintNotes()
                     AddImgToList(sFlagFileList+j, img->filename);
         }
 
+        /* The mirroring comes first, then the rotation */
+        if (img->mirrored)
+            AddImgToList(&mirror, img->filename);
+
         switch (img->curRot)
         {
           case 90:
@@ -350,6 +355,8 @@ void PrintNotes()
     /* Now we've looped over all the structs, so we can print out
      * the tables of rotation and notes.
      */
+    if (mirror)
+        printf("\nFlip horizontal (before rotating): %s\n", mirror);
     if (rot90)
         printf("\nRotate 90 (CW): %s\n", rot90);
     if (rot270)
@@ -0,0 +1,490 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * imgcache.c: keep recently shown images around, ready to display,
+ * for pho, an image viewer.
+ *
+ * Copyright 2016 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+/* Every pixbuf pho finishes scaling and rotating goes into this cache,
+ * keyed by filename, file modification time, rotation and size.
+ * Going back to an image you just looked at then costs nothing,
+ * as long as the view modes haven't changed.
+ *
+ * Pixbufs are never modified once they're made (scaling and rotating
+ * always make a new one), so the cache just holds a reference to
+ * the same pixbuf as gImage.
+ *
+ * The cache is limited to gCacheBytes; the least recently used
+ * entries are thrown away first. It's only used from the main thread.
+ *
+ * A screen-sized pixbuf is several megabytes, so that's only room for
+ * a couple of dozen images. Rather than being thrown away, evicted
+ * entries are compressed by a worker thread into a second tier,
+ * limited to gPackedCacheBytes. Photos don't compress well as they
+ * are, so each row is stored as differences from the pixel to the
+ * left (PNG's "Sub" filter) before deflating at zlib's fastest
+ * level, which about halves them. Unpacking one takes a small
+ * fraction of the time it takes to decode the JPEG again, and a hit
+ * moves it back to the first tier.
+ */
+
+#include "pho.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+/* How much memory the cache may use. Set with -M. */
+long gCacheBytes = 128 * 1024 * 1024;
+
+/* How much the compressed tier may use. Set with -Z. */
+long gPackedCacheBytes = 256 * 1024 * 1024;
+
+/* Sizes within this many pixels of what we want are good enough:
+ * ScaleAndRotate won't bother rescaling them either.
+ */
+#define CACHE_SLOP 5
+
+typedef struct {
+    char* filename;
+    time_t mtime;
+    int rot;
+    int trueWidth, trueHeight;  /* unrotated size of the original */
+    GdkPixbuf* pixbuf;          /* scaled, and rotated by rot */
+    long bytes;
+} CacheEntry;
+
+/* A compressed entry: everything needed to rebuild the pixbuf */
+typedef struct {
+    char* filename;
+    time_t mtime;
+    int rot;
+    int trueWidth, trueHeight;
+    int width, height, nChannels;
+    gboolean hasAlpha;
+    GdkPixbuf* pixbuf;          /* only until a worker has packed it */
+    unsigned char* data;        /* deflated, filtered rows */
+    long bytes;
+} PackedEntry;
+
+/* Most recently used at the head */
+static GQueue sCache = { 0, 0, 0 };
+static long sCacheUsed = 0;
+static GQueue sPacked = { 0, 0, 0 };
+static long sPackedUsed = 0;
+
+static long PixbufBytes(GdkPixbuf* pix)
+{
+    return (long)gdk_pixbuf_get_rowstride(pix) * gdk_pixbuf_get_height(pix);
+}
+
+static time_t FileMTime(char* filename)
+{
+    struct stat st;
+    if (stat(filename, &st) != 0)
+        return 0;
+    return st.st_mtime;
+}
+
+static void FreeEntry(CacheEntry* ent)
+{
+    sCacheUsed -= ent->bytes;
+    g_object_unref(ent->pixbuf);
+    free(ent->filename);
+    free(ent);
+}
+
+static void FreePacked(PackedEntry* pe)
+{
+    if (pe->pixbuf)
+        g_object_unref(pe->pixbuf);
+    free(pe->data);
+    free(pe->filename);
+    free(pe);
+}
+
+/* Would a pixbuf of pw x ph, rotated by rot, from an original of
+ * trueWidth x trueHeight, do for geometry geom?
+ */
+static int SizeFits(int trueWidth, int trueHeight, int rot,
+                    int pw, int ph, PhoGeometry* geom)
+{
+    int w, h;
+
+    CalcDisplaySize(trueWidth, trueHeight, rot, geom, &w, &h);
+    if (rot % 180 != 0) {
+        int temp = pw; pw = ph; ph = temp;
+    }
+    return (abs(pw - w) + abs(ph - h) < CACHE_SLOP);
+}
+
+/* Deflate pe->pixbuf's rows, filtered, into pe->data.
+ * Runs in a worker thread: the pixbuf is never modified,
+ * so it's safe to read here.
+ */
+static void PackPixels(gpointer data, GCancellable* cancel)
+{
+    PackedEntry* pe = (PackedEntry*)data;
+    const guchar* pixels = gdk_pixbuf_get_pixels(pe->pixbuf);
+    int rowstride = gdk_pixbuf_get_rowstride(pe->pixbuf);
+    int nch = pe->nChannels;
+    int rowbytes = pe->width * nch;
+    unsigned char* row = malloc(rowbytes);
+    z_stream zs;
+    uLong bound;
+    int x, y, err = Z_OK;
+
+    memset(&zs, 0, sizeof zs);
+    if (!row || deflateInit(&zs, Z_BEST_SPEED) != Z_OK) {
+        free(row);
+        return;
+    }
+    bound = deflateBound(&zs, (uLong)rowbytes * pe->height);
+    pe->data = malloc(bound);
+    zs.next_out = pe->data;
+    zs.avail_out = bound;
+
+    for (y = 0; pe->data && y < pe->height && err == Z_OK; ++y) {
+        const guchar* src = pixels + y * rowstride;
+        for (x = 0; x < nch; ++x)
+            row[x] = src[x];
+        for ( ; x < rowbytes; ++x)
+            row[x] = src[x] - src[x - nch];
+        zs.next_in = row;
+        zs.avail_in = rowbytes;
+        err = deflate(&zs, (y == pe->height - 1) ? Z_FINISH : Z_NO_FLUSH);
+    }
+    deflateEnd(&zs);
+    free(row);
+
+    /* No point keeping it if it didn't shrink */
+    if (err != Z_STREAM_END || zs.total_out >= (uLong)rowbytes * pe->height) {
+        free(pe->data);
+        pe->data = 0;
+        return;
+    }
+    pe->bytes = zs.total_out;
+    pe->data = realloc(pe->data, pe->bytes);
+}
+
+/* Rebuild the pixbuf from a packed entry. Returns a new pixbuf, or 0. */
+static GdkPixbuf* UnpackPixels(PackedEntry* pe)
+{
+    GdkPixbuf* pix;
+    guchar* pixels;
+    int rowstride, nch = pe->nChannels;
+    int rowbytes = pe->width * nch;
+    z_stream zs;
+    int x, y, err = Z_OK;
+
+    pix = gdk_pixbuf_new(GDK_COLORSPACE_RGB, pe->hasAlpha, 8,
+                         pe->width, pe->height);
+    if (!pix)
+        return 0;
+    pixels = gdk_pixbuf_get_pixels(pix);
+    rowstride = gdk_pixbuf_get_rowstride(pix);
+
+    memset(&zs, 0, sizeof zs);
+    if (inflateInit(&zs) != Z_OK) {
+        g_object_unref(pix);
+        return 0;
+    }
+    zs.next_in = pe->data;
+    zs.avail_in = pe->bytes;
+
+    for (y = 0; y < pe->height; ++y) {
+        guchar* dst = pixels + y * rowstride;
+        zs.next_out = dst;
+        zs.avail_out = rowbytes;
+        while (zs.avail_out > 0 && err == Z_OK)
+            err = inflate(&zs, Z_SYNC_FLUSH);
+        if (zs.avail_out > 0)
+            break;
+        for (x = nch; x < rowbytes; ++x)
+            dst[x] += dst[x - nch];
+    }
+    inflateEnd(&zs);
+
+    if (y < pe->height) {
+        g_object_unref(pix);
+        return 0;
+    }
+    return pix;
+}
+
+/* Throw away the oldest packed entries until we're back under budget */
+static void TrimPacked(long budget)
+{
+    PackedEntry* pe;
+
+    while (sPackedUsed > budget
+           && (pe = (PackedEntry*)g_queue_pop_tail(&sPacked)) != 0) {
+        if (gDebug)
+            printf("Cache: dropping packed %s\n", pe->filename);
+        sPackedUsed -= pe->bytes;
+        FreePacked(pe);
+    }
+}
+
+/* Drop packed copies of filename at rotation rot, or any rotation
+ * if rot is -1.
+ */
+static void ForgetPacked(char* filename, int rot)
+{
+    GList* link;
+
+    for (link = sPacked.head; link; ) {
+        GList* next = link->next;
+        PackedEntry* pe = (PackedEntry*)link->data;
+        if ((rot < 0 || pe->rot == rot) && !strcmp(pe->filename, filename)) {
+            g_queue_delete_link(&sPacked, link);
+            sPackedUsed -= pe->bytes;
+            FreePacked(pe);
+        }
+        link = next;
+    }
+}
+
+/* Called from the main loop when a worker has packed an entry */
+static void FinishPacking(gpointer data)
+{
+    PackedEntry* pe = (PackedEntry*)data;
+
+    g_object_unref(pe->pixbuf);
+    pe->pixbuf = 0;
+
+    if (!pe->data || pe->bytes > gPackedCacheBytes) {
+        FreePacked(pe);
+        return;
+    }
+    if (gDebug)
+        printf("Cache: packed %s into %ld bytes\n", pe->filename, pe->bytes);
+
+    g_queue_push_head(&sPacked, pe);
+    sPackedUsed += pe->bytes;
+    TrimPacked(gPackedCacheBytes);
+}
+
+/* Have a worker compress ent's pixbuf into the second tier,
+ * then free ent.
+ */
+static void PackEntry(CacheEntry* ent)
+{
+    PackedEntry* pe;
+
+    if (gPackedCacheBytes <= 0
+        || gdk_pixbuf_get_bits_per_sample(ent->pixbuf) != 8
+        || !(pe = calloc(1, sizeof (PackedEntry)))) {
+        FreeEntry(ent);
+        return;
+    }
+
+    pe->filename = strdup(ent->filename);
+    pe->mtime = ent->mtime;
+    pe->rot = ent->rot;
+    pe->trueWidth = ent->trueWidth;
+    pe->trueHeight = ent->trueHeight;
+    pe->pixbuf = g_object_ref(ent->pixbuf);
+    pe->width = gdk_pixbuf_get_width(pe->pixbuf);
+    pe->height = gdk_pixbuf_get_height(pe->pixbuf);
+    pe->nChannels = gdk_pixbuf_get_n_channels(pe->pixbuf);
+    pe->hasAlpha = gdk_pixbuf_get_has_alpha(pe->pixbuf);
+    FreeEntry(ent);
+
+    if (!QueueWork(WORK_BACKGROUND, PackPixels, FinishPacking, pe))
+        FreePacked(pe);
+}
+
+/* Throw away the oldest entries until we're back under budget.
+ * They go to the compressed tier, if there is one.
+ */
+static void TrimCache(long budget)
+{
+    CacheEntry* ent;
+
+    while (sCacheUsed > budget
+           && (ent = (CacheEntry*)g_queue_pop_tail(&sCache)) != 0) {
+        if (gDebug)
+            printf("Cache: evicting %s (%ld bytes)\n",
+                   ent->filename, ent->bytes);
+        PackEntry(ent);
+    }
+}
+
+/* Look in the compressed tier. If it's there, unpack it, and move it
+ * back to the first tier. Returns a new reference, or 0.
+ */
+static GdkPixbuf* PackedLookup(char* filename, int rot, PhoGeometry* geom,
+                               time_t mtime,
+                               int* trueWidth, int* trueHeight)
+{
+    GList* link;
+
+    for (link = sPacked.head; link; link = link->next) {
+        PackedEntry* pe = (PackedEntry*)link->data;
+        GdkPixbuf* pix;
+
+        if (pe->rot != rot || strcmp(pe->filename, filename)
+            || pe->mtime != mtime
+            || !SizeFits(pe->trueWidth, pe->trueHeight, rot,
+                         pe->width, pe->height, geom))
+            continue;
+
+        pix = UnpackPixels(pe);
+        *trueWidth = pe->trueWidth;
+        *trueHeight = pe->trueHeight;
+        g_queue_delete_link(&sPacked, link);
+        sPackedUsed -= pe->bytes;
+        FreePacked(pe);
+        if (!pix)
+            return 0;
+
+        if (gDebug)
+            printf("Packed cache hit: %s (rot %d)\n", filename, rot);
+        CachePut(filename, rot, *trueWidth, *trueHeight, pix);
+        return pix;
+    }
+    return 0;
+}
+
+/* Look for filename, rotated by rot, scaled the way it should be
+ * for geometry geom. Returns a new reference to the pixbuf, and the
+ * unrotated size of the original in *trueWidth and *trueHeight;
+ * or 0 if it isn't cached.
+ */
+GdkPixbuf* CacheLookup(char* filename, int rot, PhoGeometry* geom,
+                       int* trueWidth, int* trueHeight)
+{
+    GList* link;
+    time_t mtime;
+
+    if (gCacheBytes <= 0 || (!sCache.head && !sPacked.head))
+        return 0;
+
+    mtime = FileMTime(filename);
+
+    for (link = sCache.head; link; link = link->next) {
+        CacheEntry* ent = (CacheEntry*)link->data;
+
+        if (ent->rot != rot || strcmp(ent->filename, filename))
+            continue;
+        if (ent->mtime != mtime)    /* file changed since we cached it */
+            continue;
+        if (!SizeFits(ent->trueWidth, ent->trueHeight, rot,
+                      gdk_pixbuf_get_width(ent->pixbuf),
+                      gdk_pixbuf_get_height(ent->pixbuf), geom))
+            continue;
+
+        /* A hit: move it to the front */
+        g_queue_unlink(&sCache, link);
+        g_queue_push_head_link(&sCache, link);
+
+        if (gDebug)
+            printf("Cache hit: %s (rot %d)\n", filename, rot);
+        *trueWidth = ent->trueWidth;
+        *trueHeight = ent->trueHeight;
+        return g_object_ref(ent->pixbuf);
+    }
+
+    return PackedLookup(filename, rot, geom, mtime, trueWidth, trueHeight);
+}
+
+/* Remember pix, which is filename rotated by rot and scaled from an
+ * original of trueWidth x trueHeight (unrotated).
+ * The cache takes its own reference.
+ */
+void CachePut(char* filename, int rot, int trueWidth, int trueHeight,
+              GdkPixbuf* pix)
+{
+    CacheEntry* ent;
+    GList* link;
+    long bytes;
+
+    if (gCacheBytes <= 0 || !pix)
+        return;
+
+    bytes = PixbufBytes(pix);
+    if (bytes > gCacheBytes)
+        return;
+
+    /* Replace any entry that this one would make redundant */
+    for (link = sCache.head; link; ) {
+        GList* next = link->next;
+        ent = (CacheEntry*)link->data;
+        if (ent->pixbuf == pix
+            || (ent->rot == rot && !strcmp(ent->filename, filename)
+                && gdk_pixbuf_get_width(ent->pixbuf)
+                   == gdk_pixbuf_get_width(pix)
+                && gdk_pixbuf_get_height(ent->pixbuf)
+                   == gdk_pixbuf_get_height(pix))) {
+            g_queue_delete_link(&sCache, link);
+            FreeEntry(ent);
+        }
+        link = next;
+    }
+    ForgetPacked(filename, rot);
+
+    ent = calloc(1, sizeof (CacheEntry));
+    if (!ent)
+        return;
+    ent->filename = strdup(filename);
+    ent->mtime = FileMTime(filename);
+    ent->rot = rot;
+    ent->trueWidth = trueWidth;
+    ent->trueHeight = trueHeight;
+    ent->pixbuf = g_object_ref(pix);
+    ent->bytes = bytes;
+
+    g_queue_push_head(&sCache, ent);
+    sCacheUsed += bytes;
+
+    TrimCache(gCacheBytes);
+}
+
+/* Forget everything cached for filename, e.g. because it was deleted. */
+void CacheForget(char* filename)
+{
+    GList* link;
+
+    ForgetPacked(filename, -1);
+
+    for (link = sCache.head; link; ) {
+        GList* next = link->next;
+        CacheEntry* ent = (CacheEntry*)link->data;
+        if (!strcmp(ent->filename, filename)) {
+            g_queue_delete_link(&sCache, link);
+            FreeEntry(ent);
+        }
+        link = next;
+    }
+}
+
+/* Parse a size like 512m, 2g or 65536k into bytes. Returns -1 if bogus. */
+long ParseByteSize(char* str)
+{
+    char* end;
+    double num = strtod(str, &end);
+
+    if (end == str || num < 0)
+        return -1;
+    switch (*end) {
+      case 'g': case 'G':
+          num *= 1024;
+          /* fall through */
+      case 'm': case 'M':
+          num *= 1024;
+          /* fall through */
+      case 'k': case 'K':
+          num *= 1024;
+          ++end;
+          break;
+    }
+    if (*end != '\0')
+        return -1;
+    return (long)num;
+}
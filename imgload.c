@@ -0,0 +1,241 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * imgload.c: read image files into pixbufs, for pho, an image viewer.
+ *
+ * Copyright 2016 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+/* gdk_pixbuf_new_from_file() always decodes the whole image, even when
+ * we're about to throw most of it away scaling a 24 megapixel photo
+ * down to fit the screen. A GdkPixbufLoader tells us the image size
+ * (in its "size-prepared" signal) before it decodes anything, and lets
+ * us ask for a smaller size; the JPEG loader then decodes at 1/2, 1/4
+ * or 1/8 scale directly, which is several times faster and needs a
+ * fraction of the memory.
+ *
+ * Files are mapped rather than read, so the caller can parse the EXIF
+ * from the same mapping (touching only the first few pages) and then
+ * decode it, and the file only comes off the disk once.
+ *
+ * Images that were slow to decode last time may be waiting in the
+ * disk cache (diskcache.c), already decoded.
+ *
+ * If the EXIF orientation says the image is mirrored, it's mirrored
+ * back here, as soon as it's decoded, so everything that comes after
+ * only ever has to rotate it.
+ *
+ * The only shared state it reaches is the disk cache's directory and
+ * size limit, which are set at startup, so the workers decode with it
+ * as well as the main thread.
+ */
+
+#include "pho.h"
+#include "exif/phoexif.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+
+/* When a decode might be cancelled, the loader gets the data this
+ * much at a time, so it can be abandoned partway through.
+ */
+#define LOAD_CHUNK (256 * 1024)
+
+typedef struct {
+    int degrees;
+    PhoGeometry* geom;
+    int trueWidth, trueHeight;
+} SizeInfo;
+
+/* The size to decode a width x height image at, to show it in
+ * geometry geom rotated by degrees (-1 if the rotation isn't known
+ * yet), in *w and *h. That's never bigger than the original;
+ * if geom is 0, it's full size.
+ */
+void CalcLoadSize(int width, int height, int degrees, PhoGeometry* geom,
+                  int* w, int* h)
+{
+    *w = width;
+    *h = height;
+    if (!geom)    /* wants full size */
+        return;
+
+    if (degrees >= 0)
+        CalcDisplaySize(width, height, degrees, geom, w, h);
+    else {
+        /* We don't know the rotation yet, so make it big enough
+         * to show either way.
+         */
+        int w2, h2;
+        CalcDisplaySize(width, height, 0, geom, w, h);
+        CalcDisplaySize(width, height, 90, geom, &w2, &h2);
+        if ((double)w2 * h2 > (double)*w * *h) {
+            *w = w2;
+            *h = h2;
+        }
+    }
+
+    /* Only ever shrink here: scaling up is better done from the
+     * real pixels, later.
+     */
+    if (*w <= 0 || *h <= 0 || (*w >= width && *h >= height)) {
+        *w = width;
+        *h = height;
+    }
+    if (*w > width) *w = width;
+    if (*h > height) *h = height;
+}
+
+static void SizePrepared(GdkPixbufLoader* loader, gint width, gint height,
+                         gpointer data)
+{
+    SizeInfo* info = (SizeInfo*)data;
+    int w, h;
+
+    info->trueWidth = width;
+    info->trueHeight = height;
+
+    CalcLoadSize(width, height, info->degrees, info->geom, &w, &h);
+    if (w < width || h < height)
+        gdk_pixbuf_loader_set_size(loader, w, h);
+}
+
+/* Close loader and return a new reference to its pixbuf,
+ * or 0 with *err set. ok says whether all the writes succeeded.
+ */
+static GdkPixbuf* FinishLoader(GdkPixbufLoader* loader, int ok, GError** err)
+{
+    GdkPixbuf* pix = 0;
+
+    /* The loader has to be closed even if a write failed,
+     * but then the first error is the interesting one.
+     */
+    if (ok)
+        ok = gdk_pixbuf_loader_close(loader, err);
+    else
+        gdk_pixbuf_loader_close(loader, NULL);
+
+    if (ok) {
+        pix = gdk_pixbuf_loader_get_pixbuf(loader);
+        if (pix)
+            g_object_ref(pix);
+        else
+            g_set_error(err, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                        "No image data");
+    }
+    g_object_unref(loader);
+    return pix;
+}
+
+/* If pix's EXIF orientation says it's mirrored, mirror it back,
+ * leaving only the rotation to do.
+ */
+static void UnmirrorPixbuf(GdkPixbuf* pix)
+{
+    const gchar* orient = gdk_pixbuf_get_option(pix, "orientation");
+
+    if (orient && ExifOrientationMirror(atoi(orient)))
+        MirrorPixbuf(pix);
+}
+
+/* Decode the image in data, len bytes long, at the size it should be
+ * shown in geometry geom, before being rotated by degrees (-1 if the
+ * rotation isn't known yet), but after any mirroring is undone.
+ * If geom is 0, load it at full size.
+ * The size of the original image goes in *trueWidth and *trueHeight.
+ * If cancel isn't 0, cancelling it stops the decode.
+ * Returns a new pixbuf, or 0 with *err set.
+ */
+GdkPixbuf* LoadPixbufFromBuffer(const guchar* data, gsize len, int degrees,
+                                PhoGeometry* geom,
+                                int* trueWidth, int* trueHeight,
+                                GCancellable* cancel, GError** err)
+{
+    GdkPixbufLoader* loader;
+    GdkPixbuf* pix;
+    SizeInfo info;
+    gsize chunk = (cancel ? LOAD_CHUNK : len);
+    int ok = TRUE;
+
+    info.degrees = degrees;
+    info.geom = geom;
+    info.trueWidth = info.trueHeight = 0;
+
+    loader = gdk_pixbuf_loader_new();
+    g_signal_connect(G_OBJECT(loader), "size-prepared",
+                     G_CALLBACK(SizePrepared), &info);
+
+    while (ok && len > 0) {
+        gsize n = MIN(len, chunk);
+        if (g_cancellable_set_error_if_cancelled(cancel, err))
+            ok = FALSE;
+        else
+            ok = gdk_pixbuf_loader_write(loader, data, n, err);
+        data += n;
+        len -= n;
+    }
+
+    pix = FinishLoader(loader, ok, err);
+    if (pix) {
+        UnmirrorPixbuf(pix);
+        *trueWidth = info.trueWidth;
+        *trueHeight = info.trueHeight;
+    }
+    return pix;
+}
+
+/* Load filename, whose contents are in map, at the size it should be
+ * shown in geometry geom: see LoadPixbufFromBuffer. If it's in the
+ * disk cache, it doesn't need decoding; if it was slow to decode,
+ * it goes in the disk cache for next time.
+ */
+GdkPixbuf* LoadPixbufFromMap(char* filename, GMappedFile* map, int degrees,
+                             PhoGeometry* geom,
+                             int* trueWidth, int* trueHeight,
+                             GCancellable* cancel, GError** err)
+{
+    GdkPixbuf* pix;
+    gint64 start;
+
+    pix = DiskCacheLoad(filename, degrees, geom, trueWidth, trueHeight);
+    if (pix)
+        return pix;
+
+    start = g_get_monotonic_time();
+    pix = LoadPixbufFromBuffer((guchar*)g_mapped_file_get_contents(map),
+                               g_mapped_file_get_length(map),
+                               degrees, geom, trueWidth, trueHeight,
+                               cancel, err);
+    if (pix)
+        DiskCacheSave(filename, pix, *trueWidth, *trueHeight,
+                      g_get_monotonic_time() - start);
+    return pix;
+}
+
+/* Load filename at the size it should be shown in geometry geom:
+ * see LoadPixbufFromMap.
+ */
+GdkPixbuf* LoadPixbufForDisplay(char* filename, int degrees,
+                                PhoGeometry* geom,
+                                int* trueWidth, int* trueHeight,
+                                GCancellable* cancel, GError** err)
+{
+    GMappedFile* map = g_mapped_file_new(filename, FALSE, err);
+    GdkPixbuf* pix;
+
+    if (!map)
+        return 0;
+    pix = LoadPixbufFromMap(filename, map, degrees, geom,
+                            trueWidth, trueHeight, cancel, err);
+    g_mapped_file_unref(map);
+    return pix;
+}
+
+/* Decode an image that's already in memory, such as an EXIF thumbnail,
+ * at its own size. Returns a new pixbuf, or 0 with *err set.
+ */
+GdkPixbuf* LoadPixbufFromData(const guchar* data, gsize len, GError** err)
+{
+    int w, h;
+    return LoadPixbufFromBuffer(data, len, 0, NULL, &w, &h, NULL, err);
+}
@@ -0,0 +1,128 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * interp.c: pick how to interpolate when scaling, for pho,
+ * an image viewer.
+ *
+ * Copyright 2016 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+/* RESAMPLE_BEST looks best, but on a big image on a slow machine
+ * it can take long enough that the user notices; RESAMPLE_NEAREST
+ * is nearly free but looks rough. Rather than pick one for everybody,
+ * ScaleWithinBudget() keeps track of how fast scaling has actually
+ * been running on this machine, and uses the best interpolation that
+ * it expects to finish within SCALE_BUDGET_MS.
+ * When the machine is busy the estimates go up, so it gets faster
+ * (and rougher); when it isn't, it gets better. When the user is in a
+ * hurry, stepping from one image to the next, the budget is only
+ * DRAFT_BUDGET_MS: anything less than the best is only a draft,
+ * and ScaleBest() can redo it properly once they stop.
+ *
+ * The cost of a scale is modeled as a time per unit of work, where
+ * the work is the number of pixels written, plus, for anything but
+ * NEAREST, the number read (the filters look at every source pixel
+ * when shrinking), weighted by how much slower each interpolation is
+ * than FAST. How the kinds compare doesn't change much from one
+ * machine to the next; what changes is how fast the machine is and
+ * how busy, which is the one number that's measured, as a running
+ * average over each scale that's timed.
+ *
+ * All of them are done by ScaleRotatePixbuf(), which rotates
+ * as it goes, so rotating doesn't add anything worth counting.
+ * Linear light (gLinearLight) costs BEST and FAST about the same
+ * extra, so that comes out in the measuring too.
+ *
+ * Main thread only.
+ */
+
+#include "pho.h"
+
+#include <stdio.h>
+
+/* How long the user should have to wait for a scale */
+#define SCALE_BUDGET_MS 50
+#define DRAFT_BUDGET_MS 10
+
+/* Scales smaller than this are too quick to time usefully */
+#define MIN_TIMED_WORK 100000
+
+/* Best first. BEST is only slower than FAST when it uses Lanczos,
+ * at reductions of less than 3 or so; at big reductions both average.
+ */
+static struct {
+    int quality;            /* RESAMPLE_* */
+    const char* name;
+    double cost;            /* relative to FAST */
+} sInterps[] = {
+    { RESAMPLE_BEST,    "best",    1.5 },
+    { RESAMPLE_FAST,    "fast",    1.0 },
+    { RESAMPLE_NEAREST, "nearest", 0.25 },
+};
+#define NUM_INTERPS ((sizeof sInterps) / (sizeof *sInterps))
+
+/* Nanoseconds per unit of FAST work. Starts out on the slow side,
+ * so the first few images err towards being quick.
+ */
+static double sNsPerUnit = 5.;
+
+/* How much work scaling src to width x height is, with sInterps[i] */
+static double ScaleWork(int i, GdkPixbuf* src, int width, int height)
+{
+    double work = (double)width * height;
+
+    if (sInterps[i].quality != RESAMPLE_NEAREST)
+        work += (double)gdk_pixbuf_get_width(src)
+            * gdk_pixbuf_get_height(src);
+    return work * sInterps[i].cost;
+}
+
+/* Scale src to width x height, then rotate it by degrees,
+ * as well as can be done in time, which is less if hurry is set.
+ * *draft is set if it could have been done better.
+ * Returns a new pixbuf, or 0 if it fails.
+ */
+GdkPixbuf* ScaleWithinBudget(GdkPixbuf* src, int width, int height,
+                             int degrees, int hurry, int* draft)
+{
+    GdkPixbuf* pix;
+    gint64 start;
+    double work, ns;
+    double budget = (hurry ? DRAFT_BUDGET_MS : SCALE_BUDGET_MS) * 1e6;
+    int i;
+
+    /* The best one that should make it, or the fastest if none will */
+    for (i = 0; i < NUM_INTERPS - 1; ++i)
+        if (ScaleWork(i, src, width, height) * sNsPerUnit <= budget)
+            break;
+    *draft = (i > 0);
+
+    start = g_get_monotonic_time();
+    pix = ScaleRotatePixbuf(src, width, height, degrees,
+                            sInterps[i].quality
+                            | (gLinearLight ? RESAMPLE_LINEAR : 0));
+    ns = (g_get_monotonic_time() - start) * 1000.;
+
+    work = ScaleWork(i, src, width, height);
+    if (pix && work >= MIN_TIMED_WORK) {
+        sNsPerUnit = .75 * sNsPerUnit + .25 * ns / work;
+        if (gDebug)
+            printf("Scaled %dx%d to %dx%d, rotated %d, with %s in %.1f ms "
+                   "(now %.2f ns/unit)\n",
+                   gdk_pixbuf_get_width(src), gdk_pixbuf_get_height(src),
+                   width, height, degrees, sInterps[i].name, ns / 1e6,
+                   sNsPerUnit);
+    }
+    return pix;
+}
+
+/* Scale src to width x height, then rotate it by degrees, as well as
+ * it can be done, however long that takes. Unlike ScaleWithinBudget(),
+ * it doesn't time itself into sNsPerUnit, so workers can use it.
+ */
+GdkPixbuf* ScaleBest(GdkPixbuf* src, int width, int height, int degrees)
+{
+    return ScaleRotatePixbuf(src, width, height, degrees,
+                             sInterps[0].quality
+                             | (gLinearLight ? RESAMPLE_LINEAR : 0));
+}
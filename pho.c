@@ -47,14 +47,99 @@ int gPendingTimeout = 0;
 int gRepeat = 0;
 
 static int RotateImage(PhoImage* img, int degrees);    /* forward */
+static void NoteRotation(PhoImage* img, int degrees);  /* forward */
+static void StopRefine();    /* forward */
+
+#define SWAP(a, b) { int temp = a; a = b; b = temp; }
+/*#define SWAP(a, b)  {a ^= b; b ^= a; a ^= b;}*/
+
+/* If we're showing a quick preview of an image (from its EXIF
+ * thumbnail, or a partly loaded image) while the real thing
+ * is still being decoded, this is the image.
+ * Previews never go in the cache.
+ */
+static PhoImage* sPreviewImage = 0;
+
+/* Images smaller than this decode quickly enough
+ * that a preview isn't worth the trouble.
+ */
+#define PREVIEW_MIN_PIXELS (2 * 1024 * 1024)
+
+/* A full size, unrotated copy of the current image, once we've had
+ * to decode it at full size anyway, so that zooming in doesn't mean
+ * reading and decoding the file all over again.
+ * It's level 0 of a pyramid of successively half-sized copies,
+ * made as they're needed, so every zoom step can scale from the
+ * nearest level that's bigger than it needs, rather than from
+ * whatever size gImage happens to be.
+ */
+#define MAX_PYRAMID_LEVELS 16
+#define PYRAMID_MIN_SIZE 64
+static GdkPixbuf* sPyramid[MAX_PYRAMID_LEVELS];
+static PhoImage* sMasterImage = 0;
+
+static void ForgetMaster()
+{
+    int i;
+    for (i=0; i<MAX_PYRAMID_LEVELS; ++i) {
+        if (sPyramid[i])
+            g_object_unref(sPyramid[i]);
+        sPyramid[i] = 0;
+    }
+    sMasterImage = 0;
+}
+
+/* Keep pix as the master for img, if it's full size. */
+static void MaybeKeepMaster(PhoImage* img, GdkPixbuf* pix,
+                            int trueWidth, int trueHeight)
+{
+    if (gdk_pixbuf_get_width(pix) != trueWidth
+        || gdk_pixbuf_get_height(pix) != trueHeight)
+        return;
+    ForgetMaster();
+    sPyramid[0] = g_object_ref(pix);
+    sMasterImage = img;
+}
+
+/* The smallest pyramid level that's at least width x height
+ * (unrotated), making it if need be. There must be a master.
+ */
+static GdkPixbuf* PyramidLevel(int width, int height)
+{
+    int i;
+
+    for (i=1; i<MAX_PYRAMID_LEVELS; ++i) {
+        GdkPixbuf* prev = sPyramid[i-1];
+        int w = (gdk_pixbuf_get_width(prev) + 1) / 2;
+        int h = (gdk_pixbuf_get_height(prev) + 1) / 2;
+
+        if (w < width || h < height || w < PYRAMID_MIN_SIZE
+            || h < PYRAMID_MIN_SIZE)
+            break;
+        if (!sPyramid[i]) {
+            /* Halving: FAST averages each 2x2 */
+            int quality = RESAMPLE_FAST
+                | (gLinearLight ? RESAMPLE_LINEAR : 0);
+            sPyramid[i] = ScaleRotatePixbuf(prev, w, h, 0, quality);
+            if (!sPyramid[i])
+                break;
+            if (gDebug)
+                printf("Made pyramid level %d, %dx%d\n", i, w, h);
+        }
+    }
+    return sPyramid[i-1];
+}
 
 static gint DelayTimer(gpointer data)
 {
+    /* Either way this timer is done, so ShowImage() can add another
+     * if the slideshow starts up again (after grid mode, say).
+     */
+    gPendingTimeout = 0;
     if (gDelayMillis == 0)    /* slideshow mode was cancelled */
         return FALSE;
 
     if (gDebug) printf("-- Timer fired\n");
-    gPendingTimeout = 0;
 
     NextImage();
     return FALSE;       /* cancel the timer */
@@ -65,6 +150,9 @@ int ShowImage()
     ScaleAndRotate(gCurImage, 0);
     /* Keywords dialog will be updated if necessary from DrawImage */
 
+    /* Get a head start on wherever the user goes next */
+    PrefetchNeighbors();
+
     if (gDelayMillis > 0 && gPendingTimeout == 0
         && (gCurImage->next != 0 || gCurImage->next != gFirstImage)) {
         if (gDebug) printf("Adding timeout for %d msec\n", gDelayMillis);
@@ -74,16 +162,43 @@ int ShowImage()
     return 0;
 }
 
-static int LoadImageFromFile(PhoImage* img)
+/* Read the EXIF rotation and mirroring, which also makes the rest of the
+ * EXIF info (HasExif(), ExifGetString()) refer to this image.
+ * If map isn't 0 it has the file's contents, so we needn't read it.
+ */
+static void ReadExifRotation(PhoImage* img, GMappedFile* map)
 {
-    GError* err = NULL;
     int rot;
 
+    if (map)
+        ExifReadInfoFromData(img->filename,
+                             (unsigned char*)g_mapped_file_get_contents(map),
+                             g_mapped_file_get_length(map));
+    else
+        ExifReadInfo(img->filename);
+    if (HasExif() && (rot = ExifGetInt(ExifOrientation)) != 0)
+        img->exifRot = rot;
+    else
+        img->exifRot = 0;
+    img->mirrored = HasExif() && ExifGetMirror();
+}
+
+/* Load img from its file, decoding it at the size it will be shown at
+ * after being rotated by degrees, as far as the image format allows.
+ * The image isn't actually rotated: that's up to the caller.
+ * If map isn't 0, it has the contents of the file already.
+ */
+static int LoadImageFromFile(PhoImage* img, int degrees, GMappedFile* map)
+{
+    GError* err = NULL;
+    PhoGeometry geom;
+    int trueWidth, trueHeight;
+
     if (img == 0)
         return -1;
 
     if (gDebug)
-        printf("LoadImageFromFile(%s)\n", img->filename);
+        printf("LoadImageFromFile(%s, %d)\n", img->filename, degrees);
 
     /* Free the current image */
     if (gImage) {
@@ -91,38 +206,242 @@ static int LoadImageFromFile(PhoImage* img)
         gImage = 0;
     }
 
-    gImage = gdk_pixbuf_new_from_file(img->filename, &err);
+    GetCurrentGeometry(&geom);
+    if (map)
+        gImage = LoadPixbufFromMap(img->filename, map, degrees, &geom,
+                                   &trueWidth, &trueHeight, NULL, &err);
+    else
+        gImage = LoadPixbufForDisplay(img->filename, degrees, &geom,
+                                      &trueWidth, &trueHeight, NULL, &err);
     if (!gImage)
     {
         gImage = 0;
-        fprintf(stderr, "Can't open %s: %s\n", img->filename, err->message);
+        fprintf(stderr, "Can't open %s: %s\n", img->filename,
+                err ? err->message : "unknown error");
+        if (err)
+            g_error_free(err);
         return -1;
     }
     ReadCaption(img);
+    sPreviewImage = 0;
+    MaybeKeepMaster(img, gImage, trueWidth, trueHeight);
 
     img->curWidth = gdk_pixbuf_get_width(gImage);
     img->curHeight = gdk_pixbuf_get_height(gImage);
 
-    /* The first time an image is loaded, it should be rotated
-     * to its appropriate EXIF rotation. Subsequently, though,
-     * it should be rotated to curRot.
-     */
-    if (img->trueWidth == 0 || img->trueHeight == 0) {
-        /* Read the EXIF rotation if we haven't already rotated this image */
-        ExifReadInfo(img->filename);
-        if (HasExif() && (rot = ExifGetInt(ExifOrientation)) != 0)
-            img->exifRot = rot;
-        else
-            img->exifRot = 0;
-    }
-
     /* trueWidth and Height used to be set inside EXIF clause,
      * but that doesn't make sense -- we need it not just the first
      * time, but also ever time the image is reloaded.
+     * They're the size of the original, not of what we decoded.
      */
-    img->trueWidth = img->curWidth;
-    img->trueHeight = img->curHeight;
+    img->trueWidth = trueWidth;
+    img->trueHeight = trueHeight;
+
+    return 0;
+}
+
+/* Make gImage the full size, unrotated img: from the master if we
+ * have one, otherwise from the file (and then keep it as the master).
+ */
+static int LoadFullSize(PhoImage* img)
+{
+    GError* err = NULL;
+    GdkPixbuf* pix;
+    int trueWidth, trueHeight;
+
+    if (sMasterImage == img) {
+        if (gDebug)
+            printf("Using full size master of %s\n", img->filename);
+        pix = g_object_ref(sPyramid[0]);
+        trueWidth = gdk_pixbuf_get_width(pix);
+        trueHeight = gdk_pixbuf_get_height(pix);
+    }
+    else {
+        pix = LoadPixbufForDisplay(img->filename, 0, NULL,
+                                   &trueWidth, &trueHeight, NULL, &err);
+        if (!pix) {
+            fprintf(stderr, "Can't open %s: %s\n", img->filename,
+                    err ? err->message : "unknown error");
+            if (err)
+                g_error_free(err);
+            return -1;
+        }
+        MaybeKeepMaster(img, pix, trueWidth, trueHeight);
+    }
+
+    if (gImage)
+        g_object_unref(gImage);
+    gImage = pix;
+    sPreviewImage = 0;
+
+    img->curWidth = trueWidth;
+    img->curHeight = trueHeight;
+    img->trueWidth = trueWidth;
+    img->trueHeight = trueHeight;
+    img->curRot = 0;
+    return 0;
+}
+
+/* Make pix, which is already scaled and rotated by rot,
+ * the current image. trueWidth and trueHeight are the size
+ * of the unrotated original.
+ */
+static void InstallPixbuf(PhoImage* img, GdkPixbuf* pix, int rot,
+                          int trueWidth, int trueHeight)
+{
+    if (gImage)
+        g_object_unref(gImage);
+    gImage = pix;
+    ReadCaption(img);
+    sPreviewImage = 0;
+
+    img->curWidth = gdk_pixbuf_get_width(gImage);
+    img->curHeight = gdk_pixbuf_get_height(gImage);
+    img->curRot = rot;
+
+    /* Same convention as RotateImage: true size follows the rotation */
+    if (rot % 180 != 0) {
+        img->trueWidth = trueHeight;
+        img->trueHeight = trueWidth;
+    } else {
+        img->trueWidth = trueWidth;
+        img->trueHeight = trueHeight;
+    }
+}
+
+/* If we showed img recently, at this rotation and the current
+ * geometry, just reuse the pixbuf.
+ */
+static int UseCachedImage(PhoImage* img, int rot)
+{
+    PhoGeometry geom;
+    GdkPixbuf* pix;
+    int trueWidth, trueHeight;
+
+    GetCurrentGeometry(&geom);
+    pix = CacheLookup(img->filename, rot, &geom, &trueWidth, &trueHeight);
+    if (!pix)
+        return -1;
+
+    InstallPixbuf(img, pix, rot, trueWidth, trueHeight);
+    return 0;
+}
+
+/* If the prefetcher has already decoded, scaled and rotated img
+ * for the current geometry, make that the current image.
+ * If it's still working on it and wait is set, wait for it.
+ * rot is the rotation we want; img->curRot will be set to whatever
+ * rotation the prefetcher applied, which may be different.
+ */
+static int UsePrefetchedImage(PhoImage* img, int rot, int wait)
+{
+    PhoGeometry geom;
+    GdkPixbuf* pix;
+    int trueWidth, trueHeight;
+
+    GetCurrentGeometry(&geom);
+    pix = PrefetchTake(img, &geom, wait, &rot, &trueWidth, &trueHeight);
+    if (!pix)
+        return -1;
+
+    if (gDebug)
+        printf("Using prefetched %s\n", img->filename);
+
+    InstallPixbuf(img, pix, rot, trueWidth, trueHeight);
+    return 0;
+}
+
+static gboolean FinishPreview(gpointer data);    /* forward */
+static void FinishProgressive(PhoImage* img, GdkPixbuf* pix,
+                              int trueWidth, int trueHeight);
+
+/* Show img right away, scaled up from the thumbnail in its EXIF
+ * (or failing that, from the shared thumbnail store),
+ * and have the workers decode the real image meanwhile.
+ * The EXIF info must already have been read for img.
+ */
+static int ShowQuickPreview(PhoImage* img, int rot)
+{
+    unsigned char* thumb;
+    unsigned int thumbsize;
+    int trueWidth, trueHeight, new_width, new_height, w, h;
+    int thumbRot = 0;    /* how the thumbnail is rotated already */
+    PhoGeometry geom;
+    GdkPixbuf* pix = 0;
+    GdkPixbuf* newpix;
+
+    /* The EXIF usually says how big the image is; if not, the header does */
+    if (!ExifGetImageSize(&trueWidth, &trueHeight)) {
+        trueWidth = img->fileWidth;
+        trueHeight = img->fileHeight;
+    }
+
+    if (trueWidth > 0 && ExifGetThumbnail(&thumb, &thumbsize)) {
+        if ((double)trueWidth * trueHeight < PREVIEW_MIN_PIXELS)
+            return -1;
+        pix = LoadPixbufFromData(thumb, thumbsize, NULL);
+        /* The thumbnail has no orientation of its own */
+        if (pix && img->mirrored)
+            MirrorPixbuf(pix);
+    }
+    if (!pix) {
+        /* Stored thumbnails are mirrored and rotated
+         * to the EXIF orientation
+         */
+        pix = ThumbnailLoad(img->filename, THUMB_LARGE, &w, &h);
+        if (!pix)
+            return -1;
+        if (w > 0) {
+            trueWidth = w;
+            trueHeight = h;
+        }
+        thumbRot = img->exifRot;
+        if ((double)trueWidth * trueHeight < PREVIEW_MIN_PIXELS) {
+            g_object_unref(pix);
+            return -1;
+        }
+    }
+
+    GetCurrentGeometry(&geom);
+    CalcDisplaySize(trueWidth, trueHeight, rot, &geom,
+                    &new_width, &new_height);
+    if (thumbRot % 180 != 0)
+        SWAP(new_width, new_height);
+    newpix = ScaleRotatePixbuf(pix, new_width, new_height,
+                               (rot - thumbRot + 360) % 360, RESAMPLE_FAST);
+    g_object_unref(pix);
+    if (!newpix)
+        return -1;
+
+    /* No threads to decode the real thing? Then no preview either. */
+    if (PrefetchNow(img, rot, FinishPreview) != 0) {
+        g_object_unref(newpix);
+        return -1;
+    }
+
+    if (gDebug)
+        printf("Showing quick preview of %s\n", img->filename);
+
+    InstallPixbuf(img, newpix, rot, trueWidth, trueHeight);
+    sPreviewImage = img;
+    return 0;
+}
+
+/* Start loading img a piece at a time, showing what we have so far. */
+static int ShowProgressive(PhoImage* img, int rot, GMappedFile* map)
+{
+    PhoGeometry geom;
+    GdkPixbuf* pix;
+    int trueWidth, trueHeight;
+
+    GetCurrentGeometry(&geom);
+    pix = ProgressiveStart(img, map, rot, &geom, FinishProgressive,
+                           &trueWidth, &trueHeight);
+    if (!pix)
+        return -1;
 
+    InstallPixbuf(img, pix, rot, trueWidth, trueHeight);
+    sPreviewImage = img;
     return 0;
 }
 
@@ -131,27 +450,125 @@ static int LoadImageAndRotate(PhoImage* img)
     int e;
     int rot = (img ? img->curRot : 0);
     int firsttime = (img && (img->trueWidth == 0));
+    GMappedFile* map;
 
     if (!img) return -1;
 
     img->trueWidth = img->trueHeight = img->curRot = 0;
+    sPreviewImage = 0;
+    ProgressiveStop(0);
+    StopRefine();
+    ForgetMaster();
+
+    /* Map the file once, for both the EXIF and the image itself.
+     * If all we need is the EXIF, only its first few pages get read.
+     * If it can't be mapped, everything reads the file the old way.
+     */
+    map = g_mapped_file_new(img->filename, FALSE, NULL);
 
-    e = LoadImageFromFile(img);
-    if (e) return e;
+    /* If the validator hasn't got to it yet, find its size now:
+     * it's only a few bytes from the header.
+     */
+    if (!img->fileWidth && map)
+        ProbeImageSize((unsigned char*)g_mapped_file_get_contents(map),
+                       g_mapped_file_get_length(map),
+                       &img->fileWidth, &img->fileHeight);
+
+    /* This also makes the EXIF info refer to img */
+    ReadExifRotation(img, map);
 
     /* If it's not the first time we've loaded this image,
      * default its rotation to the EXIF rotation if any.
      * Otherwise rotate to the saved img->curRot.
      */
-    if (firsttime && img->exifRot != 0)
-        ScaleAndRotate(gCurImage, img->exifRot);
+    if (firsttime)
+        rot = img->exifRot;
 
-    else
-        ScaleAndRotate(gCurImage, rot);
+    /* We may have it cached, or the prefetcher may already
+     * have done all the work. If it's still busy with it,
+     * showing a thumbnail meanwhile beats waiting.
+     */
+    e = UseCachedImage(img, rot);
+    if (e)
+        e = UsePrefetchedImage(img, rot, FALSE);
+    if (e)
+        e = ShowQuickPreview(img, rot);
+    if (e)
+        e = UsePrefetchedImage(img, rot, TRUE);
+    if (e)
+        e = ShowProgressive(img, rot, map);
+    if (e)
+        e = LoadImageFromFile(img, rot, map);
+    if (map)
+        g_mapped_file_unref(map);
+    if (e) return e;
+
+    /* Either way, the image bits may already be rotated by curRot. */
+    ScaleAndRotate(gCurImage, rot - img->curRot);
 
     return 0;
 }
 
+/* We showed a preview of img, but the image itself won't load. */
+static void SkipBadImage(PhoImage* img)
+{
+    if (gDebug)
+        printf("Skipping '%s' (didn't load)\n", img->filename);
+    DeleteItem(img);
+    if (!gFirstImage)
+        EndSession();
+    ThisImage();
+}
+
+/* Called from the main loop when the prefetcher has finished
+ * (or given up on) the image we're showing a preview of:
+ * replace the preview with the real thing.
+ */
+static gboolean FinishPreview(gpointer data)
+{
+    PhoImage* img = sPreviewImage;
+    int rot;
+
+    if (!img || img != gCurImage)
+        return FALSE;
+
+    /* The user may have rotated the preview already */
+    rot = img->curRot;
+
+    if (UsePrefetchedImage(img, rot, FALSE) != 0
+        && LoadImageFromFile(img, rot, 0) != 0) {
+        SkipBadImage(img);
+        return FALSE;
+    }
+
+    ScaleAndRotate(img, rot - img->curRot);
+    return FALSE;
+}
+
+/* Called when a progressive load has finished. pix is the full size,
+ * unrotated image, or 0 if it couldn't be loaded.
+ */
+static void FinishProgressive(PhoImage* img, GdkPixbuf* pix,
+                              int trueWidth, int trueHeight)
+{
+    int rot;
+
+    if (img != sPreviewImage || img != gCurImage) {
+        if (pix)
+            g_object_unref(pix);
+        return;
+    }
+    if (!pix) {
+        SkipBadImage(img);
+        return;
+    }
+
+    rot = img->curRot;
+    MaybeKeepMaster(img, pix, trueWidth, trueHeight);
+    InstallPixbuf(img, pix, 0, trueWidth, trueHeight);
+    ScaleAndRotate(img, rot);
+}
+
 /* ThisImage() is called when gCurImage has changed and needs to
  * be reloaded.
  */
@@ -227,24 +644,173 @@ int NextImage()
 
 int PrevImage()
 {
+    PhoImage* bad;
+    int skipped = 0;
+
     if (gDebug)
         printf("\n================= PrevImage ====================\n");
-    do {
+    while (1) {
+        if (gFirstImage == 0)
+            return -1;
+
         if (gCurImage == 0) {  /* no image loaded yet, first call */
             gCurImage = gFirstImage;
             if (gCurImage->prev)
                 gCurImage = gCurImage->prev;
         }
         else {
-            if (gCurImage == gFirstImage)
-                return -1;  /* end of list */
+            if (gCurImage == gFirstImage) {   /* end of list */
+                /* If we skipped bad images to get here, the one we
+                 * started from was replaced and needs loading again.
+                 */
+                if (skipped)
+                    ThisImage();
+                return -1;
+            }
             gCurImage = gCurImage->prev;
         }
-    } while (LoadImageAndRotate(gCurImage) != 0);
-    ShowImage();
+
+        if (LoadImageAndRotate(gCurImage) == 0) {
+            ShowImage();
+            return 0;
+        }
+
+        /* Like NextImage, remove it from the list so we don't trip
+         * over it again, and back up to the image after it, so
+         * going ->prev again gets the one before it.
+         */
+        if (gDebug)
+            printf("Skipping '%s' (didn't load)\n", gCurImage->filename);
+        bad = gCurImage;
+        gCurImage = bad->next;
+        DeleteItem(bad);
+        skipped = 1;
+    }
+    /* NOTREACHED */
     return 0;
 }
 
+/* Holding down space or PageDown used to load every image the key
+ * repeat went past, decoding each in full just to throw it away.
+ * Now when navigation keys come closer together than NAV_REPEAT_MS,
+ * we stop whatever was loading and only keep track of where the user
+ * is headed, showing each image's name and whatever thumbnail is at
+ * hand on the way. Once the keys have stopped for NAV_SETTLE_MS,
+ * the image they landed on gets loaded properly.
+ */
+#define NAV_REPEAT_MS 150
+#define NAV_SETTLE_MS 120
+
+/* Keys closer together than this mean the user is stepping through
+ * the images, and getting each one up fast matters more than
+ * getting it perfect.
+ */
+#define STEPPING_MS 1000
+
+static PhoImage* sSkipTarget = 0;   /* where the user is headed */
+static guint sSkipTimeout = 0;
+static guint32 sLastNavTime = 0;
+static int sStepping = 0;
+
+/* Show img's name, and a thumbnail if one is cheap to get */
+static void ShowSkipping(PhoImage* img)
+{
+    GdkPixbuf* pix = 0;
+    int w, h;
+
+    /* If it was shown recently, the real thing is in the cache */
+    if (img->trueWidth) {
+        PhoGeometry geom;
+        GetCurrentGeometry(&geom);
+        pix = CacheLookup(img->filename, img->curRot, &geom, &w, &h);
+    }
+    if (!pix)
+        pix = ThumbnailLoad(img->filename, THUMB_NORMAL, &w, &h);
+
+    DrawSkipping(img, pix);
+    if (pix)
+        g_object_unref(pix);
+}
+
+static gboolean SkipTimer(gpointer data)
+{
+    sSkipTimeout = 0;
+    FinishSkipping();
+    return FALSE;
+}
+
+/* Called for each navigation key, at time (from the key event),
+ * going forward if dir > 0, else backward.
+ * Returns 1 if the keys are coming too fast to load each image,
+ * in which case it's taken care of the move; otherwise returns 0
+ * and the caller should call NextImage() or PrevImage() as usual.
+ */
+int SkipImages(int dir, guint32 time)
+{
+    PhoImage* from;
+    PhoImage* to;
+    int repeating = (sLastNavTime != 0
+                     && time - sLastNavTime < NAV_REPEAT_MS);
+
+    sStepping = (sLastNavTime != 0 && time - sLastNavTime < STEPPING_MS);
+    sLastNavTime = time;
+    if (!gCurImage || (!sSkipTarget && !repeating))
+        return 0;
+
+    if (!sSkipTarget) {
+        /* Whatever is loading now, nobody's going to look at it */
+        if (gDebug)
+            printf("Skipping ahead from %s\n", gCurImage->filename);
+        ProgressiveStop(0);
+        sPreviewImage = 0;
+        PrefetchCancel();
+    }
+
+    /* Same rules for the ends of the list as NextImage and PrevImage,
+     * except that we just stay at the end.
+     */
+    from = (sSkipTarget ? sSkipTarget : gCurImage);
+    if (dir > 0)
+        to = (from->next == gFirstImage && !gRepeat) ? from : from->next;
+    else
+        to = (from == gFirstImage) ? from : from->prev;
+    sSkipTarget = to;
+
+    ShowSkipping(to);
+
+    if (sSkipTimeout)
+        g_source_remove(sSkipTimeout);
+    sSkipTimeout = g_timeout_add(NAV_SETTLE_MS, SkipTimer, 0);
+    return 1;
+}
+
+/* If we've been skipping, load the image we ended up on.
+ * Anything that's about to use gCurImage should call this first.
+ */
+void FinishSkipping()
+{
+    if (sSkipTimeout) {
+        g_source_remove(sSkipTimeout);
+        sSkipTimeout = 0;
+    }
+    if (!sSkipTarget) {
+        /* Some other key: whatever happens next, there's time for it */
+        sStepping = 0;
+        return;
+    }
+
+    gCurImage = sSkipTarget;
+    sSkipTarget = 0;
+    ThisImage();
+}
+
+/* img is going away: if we were headed there, head for the next one */
+void SkipForget(PhoImage* img)
+{
+    if (sSkipTarget == img)
+        sSkipTarget = (img->next != img ? img->next : 0);
+}
+
 /* Limit new_width and new_height so that they're no bigger than
  * max_width and max_height. This doesn't actually scale, just
  * calculates dimensions and returns them in *width and *height.
@@ -310,8 +876,251 @@ static void ScaleToFit(int *width, int *height,
     *height = new_h * scaleRatio;
 }
 
-#define SWAP(a, b) { int temp = a; a = b; b = temp; }
-/*#define SWAP(a, b)  {a ^= b; b ^= a; a ^= b;}*/
+/* Fill in geom from the current global view settings.
+ * Only call this from the main thread: it may ask gtk for the window size.
+ */
+void GetCurrentGeometry(PhoGeometry* geom)
+{
+    /* If we're in fixed mode, make sure we've set the "scale ratio"
+     * to the screen size:
+     */
+    if (gScaleMode == PHO_SCALE_FIXED && gScaleRatio == 0.0)
+        gScaleRatio = FracOfScreenSize();
+
+    geom->scaleMode = gScaleMode;
+    geom->scaleRatio = gScaleRatio;
+    geom->monitorWidth = gMonitorWidth;
+    geom->monitorHeight = gMonitorHeight;
+
+    /* If we're in presentation mode, then fullscreen needs to scale
+     * to the current size of the window, not the monitor,
+     * because in xinerama gdk_window_fullscreen() will fullscreen
+     * onto only one monitor, but gdk_screen_width() gives the
+     * width of the full xinerama setup.
+     */
+    if (gDisplayMode == PHO_DISPLAY_PRESENTATION && gWin)
+        gtk_window_get_size(GTK_WINDOW(gWin),
+                            &geom->screenWidth, &geom->screenHeight);
+    else {
+        geom->screenWidth = gMonitorWidth;
+        geom->screenHeight = gMonitorHeight;
+    }
+}
+
+int SameGeometry(PhoGeometry* a, PhoGeometry* b)
+{
+    return (a->scaleMode == b->scaleMode
+            && a->scaleRatio == b->scaleRatio
+            && a->monitorWidth == b->monitorWidth
+            && a->monitorHeight == b->monitorHeight
+            && a->screenWidth == b->screenWidth
+            && a->screenHeight == b->screenHeight);
+}
+
+/* Calculate the size at which an image of trueWidth x trueHeight
+ * should be shown, before it's rotated by degrees, in geometry geom.
+ * That means that if the aspect ratio is changing,
+ * *width will be the image's height after rotation.
+ * It only looks at its arguments, so the workers use it too.
+ */
+void CalcDisplaySize(int trueWidth, int trueHeight, int degrees,
+                     PhoGeometry* geom, int* width, int* height)
+{
+    int new_width = trueWidth;
+    int new_height = trueHeight;
+
+    degrees = (degrees + 360) % 360;
+
+    /* Fullsize: display always at real resolution,
+     * even if it's too big to fit on the screen.
+     */
+    if (geom->scaleMode == PHO_SCALE_FULLSIZE) {
+        new_width = trueWidth * geom->scaleRatio;
+        new_height = trueHeight * geom->scaleRatio;
+        if (gDebug) printf("Now fullsize, %dx%d\n", new_width, new_height);
+    }
+
+    /* Normal: display at full size unless it won't fit the screen,
+     * in which case scale it down.
+     */
+    else if (geom->scaleMode == PHO_SCALE_NORMAL
+             || geom->scaleMode == PHO_SCALE_SCREEN_RATIO
+             || geom->scaleMode == PHO_SCALE_FIXED)
+    {
+        int max_width, max_height;
+        int aspect_changing;    /* Is the aspect ratio changing? */
+
+        aspect_changing = ((degrees % 180) != 0);
+        if (aspect_changing) {
+            max_width = geom->monitorHeight;
+            max_height = geom->monitorWidth;
+            if (gDebug)
+                printf("Aspect ratio is changing\n");
+        } else {
+            max_width = geom->monitorWidth;
+            max_height = geom->monitorHeight;
+        }
+
+        if (new_width > max_width || new_height > max_height) {
+            ScaleToFit(&new_width, &new_height, max_width, max_height,
+                       geom->scaleMode, geom->scaleRatio);
+        }
+    }
+
+    else if (geom->scaleMode == PHO_SCALE_IMG_RATIO) {
+        new_width = trueWidth * geom->scaleRatio;
+        new_height = trueHeight * geom->scaleRatio;
+    }
+        
+    /* Fullscreen: Scale either up or down if necessary to make
+     * the largest dimension match the screen size.
+     */
+    else if (geom->scaleMode == PHO_SCALE_FULLSCREEN) {
+        double xratio = (double)geom->screenWidth / trueWidth;
+        double yratio = (double)geom->screenHeight / trueHeight;
+
+        /* Use xratio for the more extreme of the two */
+        if (xratio > yratio) xratio = yratio;
+        new_width = xratio * trueWidth;
+        new_height = xratio * trueHeight;
+    }
+    else {
+        /* Shouldn't ever happen, means gScaleMode is bogus */
+        printf("Internal error: Unknown scale mode %d\n", geom->scaleMode);
+    }
+
+    *width = new_width;
+    *height = new_height;
+}
+
+/* Remember the finished product, in case we come back to it
+ * (but not if it's only a preview).
+ */
+static void CacheShownImage(PhoImage* img)
+{
+    if (img == sPreviewImage)
+        return;
+    if (img->curRot % 180 != 0)
+        CachePut(img->filename, img->curRot,
+                 img->trueHeight, img->trueWidth, gImage);
+    else
+        CachePut(img->filename, img->curRot,
+                 img->trueWidth, img->trueHeight, gImage);
+}
+
+/* When ScaleAndRotate() has to settle for a quick, rough scale
+ * (the user is stepping through images, or it's a big image on a busy
+ * machine), the draft goes up right away. If the user is still on the
+ * same image REFINE_DELAY_MS later, a worker does the scale again as
+ * well as it can be done, and the result replaces the draft.
+ */
+#define REFINE_DELAY_MS 200
+
+typedef struct {
+    PhoImage* img;          /* main thread only */
+    GdkPixbuf* src;         /* what the draft was scaled from */
+    GdkPixbuf* draft;       /* only compared with gImage */
+    int width, height;      /* to scale src to */
+    int rot;                /* then rotate by */
+    GdkPixbuf* result;
+    WorkJob* work;
+} RefineJob;
+
+static RefineJob* sRefine = 0;
+static guint sRefineTimeout = 0;
+
+static void FreeRefine(RefineJob* job)
+{
+    g_object_unref(job->src);
+    g_object_unref(job->draft);
+    if (job->result)
+        g_object_unref(job->result);
+    free(job);
+}
+
+/* Forget about improving the current image */
+static void StopRefine()
+{
+    if (sRefineTimeout) {
+        g_source_remove(sRefineTimeout);
+        sRefineTimeout = 0;
+    }
+    if (!sRefine)
+        return;
+
+    /* If a worker has it, FinishRefine() will free it */
+    if (sRefine->work)
+        CancelWork(sRefine->work);
+    else
+        FreeRefine(sRefine);
+    sRefine = 0;
+}
+
+/* Runs in a worker thread */
+static void RefinePixels(gpointer data, GCancellable* cancel)
+{
+    RefineJob* job = (RefineJob*)data;
+    job->result = ScaleBest(job->src, job->width, job->height, job->rot);
+}
+
+/* Called from the main loop with the better version */
+static void FinishRefine(gpointer data)
+{
+    RefineJob* job = (RefineJob*)data;
+    PhoImage* img = job->img;
+
+    if (job == sRefine) {
+        sRefine = 0;
+        if (job->result && img == gCurImage && gImage == job->draft
+            && gdk_pixbuf_get_width(job->result) == img->curWidth
+            && gdk_pixbuf_get_height(job->result) == img->curHeight) {
+            if (gDebug)
+                printf("Replacing draft of %s\n", img->filename);
+            g_object_unref(gImage);
+            gImage = job->result;
+            job->result = 0;
+            CacheShownImage(img);
+            DrawImage();
+        }
+    }
+    FreeRefine(job);
+}
+
+static gboolean QueueRefine(gpointer data)
+{
+    sRefineTimeout = 0;
+    if (sRefine) {
+        sRefine->work = QueueWork(WORK_CURRENT, RefinePixels, FinishRefine,
+                                  sRefine);
+        if (!sRefine->work) {
+            FreeRefine(sRefine);
+            sRefine = 0;
+        }
+    }
+    return FALSE;
+}
+
+/* gImage, showing img, is a draft: src scaled to width x height
+ * in a hurry, then rotated by rot. Make a better one soon.
+ */
+static void StartRefine(PhoImage* img, GdkPixbuf* src,
+                        int width, int height, int rot)
+{
+    StopRefine();
+    if (img == sPreviewImage || StartWorkers() != 0)
+        return;
+
+    sRefine = calloc(1, sizeof (RefineJob));
+    if (!sRefine)
+        return;
+    sRefine->img = img;
+    sRefine->src = g_object_ref(src);
+    sRefine->draft = g_object_ref(gImage);
+    sRefine->width = width;
+    sRefine->height = height;
+    sRefine->rot = rot;
+    sRefineTimeout = g_timeout_add(REFINE_DELAY_MS, QueueRefine, 0);
+}
 
 /* Rotate the image according to the current scale mode, scaling as needed,
  * then redisplay.
@@ -331,163 +1140,88 @@ int ScaleAndRotate(PhoImage* img, int degrees)
 #define true_height img->trueHeight
     int new_width;
     int new_height;
+    PhoGeometry geom;
+    GdkPixbuf* draftSrc = 0;    /* if what we show is only a draft */
+    int rotated = 0;            /* if scaling did the rotation too */
 
     if (gDebug)
         printf("ScaleAndRotate(%d (cur = %d))\n", degrees, img->curRot);
 
+    /* Anything already on its way is for the old size or rotation */
+    StopRefine();
+
     /* degrees should be between 0 and 360 */
     degrees = (degrees + 360) % 360;
 
     /* First, load the image if we haven't already, to get true w/h */
     if (true_width == 0 || true_height == 0) {
         if (gDebug) printf("Loading, first time, from ScaleAndRotate!\n");
-        LoadImageFromFile(img);
+        ReadExifRotation(img, 0);
+        LoadImageFromFile(img, degrees, 0);
     }
 
     /*
      * Calculate new_width and new_height, the size to which the image
      * should be scaled before or after rotation,
      * based on the current scale mode.
-     * That means that if the aspect ratio is changing,
-     * new_width will be the image's height after rotation.
      */
+    GetCurrentGeometry(&geom);
+    CalcDisplaySize(true_width, true_height, degrees, &geom,
+                    &new_width, &new_height);
 
-    /* Fullsize: display always at real resolution,
-     * even if it's too big to fit on the screen.
-     */
-    if (gScaleMode == PHO_SCALE_FULLSIZE) {
-        new_width = true_width * gScaleRatio;
-        new_height = true_height * gScaleRatio;
-        if (gDebug) printf("Now fullsize, %dx%d\n", new_width, new_height);
-    }
-
-    /* Normal: display at full size unless it won't fit the screen,
-     * in which case scale it down.
+    /* See if new_width and new_height are close enough already
+     * that it might not be worth doing the work of scaling:
      */
 #define NORMAL_SCALE_SLOP 5
-    else if (gScaleMode == PHO_SCALE_NORMAL
-             || gScaleMode == PHO_SCALE_SCREEN_RATIO
-             || gScaleMode == PHO_SCALE_FIXED)
-    {
-        int max_width, max_height;
-        int aspect_changing;    /* Is the aspect ratio changing? */
-
-        new_width = true_width;
-        new_height = true_height;
-
-        aspect_changing = ((degrees % 180) != 0);
-        if (aspect_changing) {
-            max_width = gMonitorHeight;
-            max_height = gMonitorWidth;
-            if (gDebug)
-                printf("Aspect ratio is changing\n");
-        } else {
-            max_width = gMonitorWidth;
-            max_height = gMonitorHeight;
-        }
-
-        /* If we're in fixed mode, make sure we've set the "scale ratio"
-         * to the screen size:
-         */
-        if (gScaleMode == PHO_SCALE_FIXED && gScaleRatio == 0.0)
-            gScaleRatio = FracOfScreenSize();
-
-        if (new_width > max_width || new_height > max_height) {
-            ScaleToFit(&new_width, &new_height, max_width, max_height,
-                       gScaleMode, gScaleRatio);
-        }
-
-#if 0
-        /* Special case: if in PHO_SCALE_SCREEN_RATIO, we don't need to
-         * scale verticals (assuming a landscape screen) down -- it's
-         * better to keep the max dimension of each image the same.
-         */
-        if (new_width <= max_height && new_height <= max_width) {
-            double r = 
-        } else {
-            new_width *= gScaleRatio;
-            new_height *= gScaleRatio;
-        }
-#endif
-
-        /* See if new_width and new_height are close enough already
-         * that it might not be worth doing the work of scaling:
-         */
-        if (abs(img->curWidth - new_width) + abs(img->curHeight - new_height)
-            < NORMAL_SCALE_SLOP) {
-            new_width = img->curWidth;
-            new_height = img->curHeight;
-        }
-    }
-
-    else if (gScaleMode == PHO_SCALE_IMG_RATIO) {
-        new_width = true_width * gScaleRatio;
-        new_height = true_height * gScaleRatio;
-
-        /* See if we're close */
+#define FULLSCREEN_SCALE_SLOP 20
+    if (gScaleMode == PHO_SCALE_NORMAL
+        || gScaleMode == PHO_SCALE_SCREEN_RATIO
+        || gScaleMode == PHO_SCALE_FIXED
+        || gScaleMode == PHO_SCALE_IMG_RATIO) {
         if (abs(img->curWidth - new_width) + abs(img->curHeight - new_height)
             < NORMAL_SCALE_SLOP) {
             new_width = img->curWidth;
             new_height = img->curHeight;
         }
     }
-        
-    /* Fullscreen: Scale either up or down if necessary to make
-     * the largest dimension match the screen size.
-     */
-#define FULLSCREEN_SCALE_SLOP 20
     else if (gScaleMode == PHO_SCALE_FULLSCREEN) {
-        /* If we're in presentation mode, then we need to scale
-         * to the current size of the window, not the monitor,
-         * because in xinerama gdk_window_fullscreen() will fullscreen
-         * onto only one monitor, but gdk_screen_width() gives the
-         * width of the full xinerama setup.
-         */
         int diffx = abs(img->curWidth - gMonitorWidth);
         int diffy = abs(img->curHeight - gMonitorHeight);
-        double xratio, yratio;
-        gint screenwidth, screenheight;
-
-        if (gDisplayMode == PHO_DISPLAY_PRESENTATION)
-            gtk_window_get_size(GTK_WINDOW(gWin), &screenwidth, &screenheight);
-        else {
-            screenwidth = gMonitorWidth;
-            screenheight = gMonitorHeight;
-        }
-
         if (diffx < FULLSCREEN_SCALE_SLOP || diffy < FULLSCREEN_SCALE_SLOP) {
             new_width = img->curWidth;
             new_height = img->curHeight;
         }
-        else {
-            xratio = (double)screenwidth / true_width;
-            yratio = (double)screenheight / true_height;
-
-            /* Use xratio for the more extreme of the two */
-            if (xratio > yratio) xratio = yratio;
-            new_width = xratio * true_width;
-            new_height = xratio * true_height;
-        }
     }
-    else {
-        /* Shouldn't ever happen, means gScaleMode is bogus */
-        printf("Internal error: Unknown scale mode %d\n", gScaleMode);
+    else if (gScaleMode != PHO_SCALE_FULLSIZE) {
+        /* Bogus scale mode: CalcDisplaySize already complained */
         new_width = img->curWidth;
         new_height = img->curHeight;
     }
+
     /*
      * Finally, we're done with the scaling modes.
      * Time to do the scaling and rotation,
      * reloading the image if needed.
      */
 
-    /* First figure out if we're getting bigger and hence need to reload. */
-    if ((new_width > img->curWidth || new_height > img->curHeight)
-        && (img->curWidth < true_width && img->curHeight < true_height)) {
+    /* First figure out if we're getting bigger and hence need to
+     * start again from the full size image. If we have it already,
+     * start from that for any change in size.
+     */
+    if (((new_width > img->curWidth || new_height > img->curHeight)
+         && (img->curWidth < true_width && img->curHeight < true_height))
+        || (sMasterImage == img && (new_width != img->curWidth
+                                    || new_height != img->curHeight))) {
+        int curRot = img->curRot;
+
         if (gDebug)
-            printf("Getting bigger, from %dx%d to %dx%d -- need to reload\n",
+            printf("Changing size, from %dx%d to %dx%d -- from full size\n",
                    img->curWidth, img->curHeight, new_width, new_height);
 
+        ProgressiveStop(img);
+        if (LoadFullSize(img) != 0)
+            return -1;
+
         /* Because curRot is going back to zero, that means we
          * might need to swap new_width and new_height, in case
          * the aspect ratio is changing.
@@ -497,21 +1231,18 @@ int ScaleAndRotate(PhoImage* img, int degrees)
          * the desired rotation (degrees); the important thing is
          * whether the current rotation is 90 degrees off.
          */
-        if (img->curRot % 180 != 0) {
+        if (curRot % 180 != 0) {
             SWAP(new_width, new_height);
             if (gDebug)
                 printf("Swapping new width/height: %dx%d\n",
                        new_width, new_height);
         }
 
-        /* image->curRot is going to be set back to zero when we load
-         * from file, so adjust current planned rotation accordingly.
+        /* image->curRot has been set back to zero by reloading,
+         * so adjust current planned rotation accordingly.
          */
-        degrees = (degrees + img->curRot + 360) % 360;
+        degrees = (degrees + curRot + 360) % 360;
             /* Now it's the absolute end rot desired */
-
-        img->curRot = 0;
-        LoadImageFromFile(img);
     }
 #if 0
     else if (degrees % 180 != 0) {
@@ -539,20 +1270,26 @@ int ScaleAndRotate(PhoImage* img, int degrees)
     /* Do the scaling (thought we'd never get there!) */
     if (new_width != img->curWidth || new_height != img->curHeight)
     {
-        GdkPixbuf* newimage = gdk_pixbuf_scale_simple(gImage,
-                                                      new_width,
-                                                      new_height,
-                                                      GDK_INTERP_BILINEAR);
-        /* If that's too slow use GDK_INTERP_NEAREST */
-
-        /* scale_simple apparently has no error return; if it fails,
-         * it still returns a pixbuf but width and height are -1.
-         * Hope this undocumented behavior doesn't change!
-         * Later: now it's documented. Whew.
+        /* With a full size master, the nearest pyramid level up
+         * is as good a place to start as any, and a lot faster.
+         * LoadFullSize has already undone any rotation.
          */
-        if (!newimage || gdk_pixbuf_get_width(newimage) < 1) {
-            if (newimage)
-                g_object_unref(newimage);
+        GdkPixbuf* src = (sMasterImage == img)
+            ? PyramidLevel(new_width, new_height) : gImage;
+        GdkPixbuf* newimage;
+        int draft = 0;
+
+        if (gdk_pixbuf_get_width(src) == new_width
+            && gdk_pixbuf_get_height(src) == new_height)
+            newimage = g_object_ref(src);
+        else {
+            /* This rotates it as well, in the same pass */
+            newimage = ScaleWithinBudget(src, new_width, new_height,
+                                         degrees, sStepping, &draft);
+            rotated = 1;
+        }
+
+        if (!newimage) {
             printf("\007Error scaling from %d x %d to %d x %d: probably out of memory\n",
                    img->curWidth, img->curHeight, new_width, new_height);
             Prompt("Couldn't scale up: probably out of memory", "Bummer", 0,
@@ -566,18 +1303,32 @@ int ScaleAndRotate(PhoImage* img, int degrees)
                    new_width, new_height,
                    gdk_pixbuf_get_width(newimage),
                    gdk_pixbuf_get_height(newimage));
+        if (draft)
+            draftSrc = g_object_ref(src);
         if (gImage)
             g_object_unref(gImage);
         gImage = newimage;
+        if (rotated)
+            NoteRotation(img, degrees);
 
         img->curWidth = gdk_pixbuf_get_width(gImage);
         img->curHeight = gdk_pixbuf_get_height(gImage);
     }
 
     /* If we didn't rotate before, do it now. */
-    if (degrees != 0)
+    if (degrees != 0 && !rotated)
         RotateImage(img, degrees);
 
+    /* A draft mustn't be cached, or coming back to the image would
+     * show it for good: FinishRefine() caches the refined version.
+     */
+    if (draftSrc) {
+        StartRefine(img, draftSrc, new_width, new_height, degrees);
+        g_object_unref(draftSrc);
+    }
+    else
+        CacheShownImage(img);
+
     /* We've finished making our changes. Now we may need to make
      * changes in the window size or position.
      */
@@ -605,6 +1356,9 @@ void ReallyDelete(PhoImage* delImg)
         return;
     }
 
+    CacheForget(delImg->filename);
+    if (delImg == sPreviewImage)
+        sPreviewImage = 0;
     DeleteItem(delImg);
 
     /* If we just deleted the last image, all we can do is quit */
@@ -624,6 +1378,7 @@ void DeleteImage(PhoImage* delImg)
         ReallyDelete(delImg);
 }
 
+
 /* RotateImage just rotates an existing image, no scaling or reloading.
  * It's typically called from ScaleAndRotate either just
  * before or just after scaling.
@@ -632,10 +1387,6 @@ void DeleteImage(PhoImage* delImg)
  */
 static int RotateImage(PhoImage* img, int degrees)
 {
-    guchar *oldpixels, *newpixels;
-    int x, y;
-    int oldrowstride, newrowstride, nchannels, bitsper, alpha;
-    int newWidth, newHeight, newTrueWidth, newTrueHeight;
     GdkPixbuf* newImage;
 
     if (!gImage) return 1;     /* sanity check */
@@ -653,77 +1404,12 @@ static int RotateImage(PhoImage* img, int degrees)
         return 0;
     }
 
-    /* Swap X and Y if appropriate */
-    if (degrees == 90 || degrees == 270)
-    {
-        newWidth = img->curHeight;
-        newHeight = img->curWidth;
-        newTrueWidth = img->trueHeight;
-        newTrueHeight = img->trueWidth;
-    }
-    else
-    {
-        newWidth = img->curWidth;
-        newHeight = img->curHeight;
-        newTrueWidth = img->trueWidth;
-        newTrueHeight = img->trueHeight;
-    }
-
-    oldrowstride = gdk_pixbuf_get_rowstride(gImage);
-    /* Sometimes rowstride is slightly different from width*nchannels:
-     * gdk_pixbuf optimizes by aligning to 32-bit boundaries.
-     * But apparently it works even if rowstride is not aligned,
-     * just might not be as fast.
-     * XXX check newrowstride alignment
-     */
-    bitsper = gdk_pixbuf_get_bits_per_sample(gImage);
-    nchannels = gdk_pixbuf_get_n_channels(gImage);
-    alpha = gdk_pixbuf_get_has_alpha(gImage);
-
-    oldpixels = gdk_pixbuf_get_pixels(gImage);
-
-    newImage = gdk_pixbuf_new(GDK_COLORSPACE_RGB, alpha, bitsper,
-                              newWidth, newHeight);
+    newImage = RotatePixbuf(gImage, degrees);
     if (!newImage) return 1;
-    newpixels = gdk_pixbuf_get_pixels(newImage);
-    newrowstride = gdk_pixbuf_get_rowstride(newImage);
 
-    for (x = 0; x < img->curWidth; ++x)
-    {
-        for (y = 0; y < img->curHeight; ++y)
-        {
-            int newx, newy;
-            int i;
-            switch (degrees)
-            {
-              case 90:
-                newx = img->curHeight - y - 1;
-                newy = x;
-                break;
-              case 270:
-                newx = y;
-                newy = img->curWidth - x - 1;
-                break;
-              case 180:
-                newx = img->curWidth - x - 1;
-                newy = img->curHeight - y - 1;
-                break;
-              default:
-                printf("Illegal rotation value!\n");
-                return 1;
-            }
-            for (i=0; i<nchannels; ++i)
-                newpixels[newy*newrowstride + newx*nchannels + i]
-                    = oldpixels[y*oldrowstride + x*nchannels + i];
-        }
-    }
-
-    img->curWidth = newWidth;
-    img->curHeight = newHeight;
-    img->trueWidth = newTrueWidth;
-    img->trueHeight = newTrueHeight;
-
-    img->curRot = (img->curRot + degrees + 360) % 360;
+    NoteRotation(img, degrees);
+    img->curWidth = gdk_pixbuf_get_width(newImage);
+    img->curHeight = gdk_pixbuf_get_height(newImage);
 
     g_object_unref(gImage);
     gImage = newImage;
@@ -731,10 +1417,23 @@ static int RotateImage(PhoImage* img, int degrees)
     return 0;
 }
 
+/* gImage has just been turned by degrees (0 to 359):
+ * keep track of the rotation in img.
+ */
+static void NoteRotation(PhoImage* img, int degrees)
+{
+    /* Swap X and Y if appropriate */
+    if (degrees == 90 || degrees == 270)
+    {
+        SWAP(img->trueWidth, img->trueHeight);
+    }
+    img->curRot = (img->curRot + degrees + 360) % 360;
+}
+
 void Usage()
 {
     printf("pho version %s.  Copyright 2002-2009 Akkana Peck akkana@shallowsky.com.\n", VERSION);
-    printf("Usage: pho [-dhnp] image [image ...]\n");
+    printf("Usage: pho [-dhnp] image|directory [image|directory ...]\n");
     printf("\t-p:  Presentation mode (full screen, centered)\n");
     printf("\t-p[resolution]: Projector mode:\n\tlike presentation mode but in upper left corner\n");
     printf("\t-P:  No presentation mode (separate window) -- default\n");
@@ -742,7 +1441,13 @@ void Usage()
     printf("\t-n:  Replace each image window with a new window (helpful for some window managers)\n");
     printf("\t-sN: Slideshow mode, where N is the timeout in seconds\n");
     printf("\t-r:  Repeat: loop back to the first image after showing the last\n");
+    printf("\t-R:  Recursive: show images in subdirectories of any directories given\n");
     printf("\t-cpattern: Caption/Comment file pattern, format string for reworking filename\n");
+    printf("\t-Msize: Memory for caching recently viewed images, e.g. -M512m (default 128m, 0 to disable)\n");
+    printf("\t-Ddir[:size]: Keep images that are slow to decode, decoded, in dir (default size 2g)\n");
+    printf("\t-Zsize: Memory for keeping older images compressed, e.g. -Z1g (default 256m, 0 to disable)\n");
+    printf("\t-l:  Scale images in linear light, keeping fine detail as bright as it should be -- default\n");
+    printf("\t-L:  Scale sRGB values directly (a little faster)\n");
     printf("\t--:  Assume no more flags will follow\n");
     printf("\t-d:  Debug messages\n");
     printf("\t-h:  Help: Print this summary\n");
@@ -761,6 +1466,8 @@ void VerboseHelp()
     printf("f\tToggle full-size mode (even if bigger than screen)\n");
     printf("F\tToggle fullscreen mode (scale even small images up to fullscreen)\n");
     printf("k\tTurn on keywords mode: show the keywords dialog\n");
+    printf("c\tContact sheet: show a grid of thumbnails of all the images\n");
+    printf("\t(<return> or a double click shows the selected one)\n");
     printf("p\tToggle presentation mode (take up the whole screen, centering the image)\n");
     printf("d\tDelete current image (from disk, after confirming with another d)\n");
     printf("0-9\tRemember image in note list 0 through 9 (to be printed at exit)\n");
@@ -21,11 +21,21 @@ typedef struct PhoImage_s {
     char* filename;
 
     int trueWidth, trueHeight;  /* may be swapped if rot = 90 or 270 */
+    int fileWidth, fileHeight;  /* from the file's header, unrotated;
+                                 * known before it's ever decoded */
     int curWidth, curHeight;
+    /* The transform from the file's pixels to the screen: mirror left
+     * to right if mirrored, then rotate clockwise by curRot. The mirror
+     * comes from the EXIF and is done as the pixels are decoded, so
+     * nothing after that needs to know about it; together with exifRot
+     * it covers all 8 EXIF orientations.
+     */
     int curRot;       /* current rotation of the current image bits */
-    int exifRot;      /* exif-specified rotation */
+    int exifRot;      /* exif-specified rotation, after any mirroring */
+    int mirrored;     /* exif says the image is mirrored */
     unsigned long noteFlags;
     unsigned int deleted;
+    unsigned int validated;     /* the validator has looked at its file */
     struct PhoImage_s* prev;
     struct PhoImage_s* next;
     char* comment;
@@ -105,6 +115,7 @@ extern double gScaleRatio;
 #define PHO_DISPLAY_NORMAL       0
 #define PHO_DISPLAY_PRESENTATION 1
 #define PHO_DISPLAY_KEYWORDS     2
+#define PHO_DISPLAY_GRID         3    /* thumbnails of the whole list */
 extern int gDisplayMode;
 
 /* Set all the view modes at once -- this will also do assorted
@@ -114,6 +125,22 @@ extern int gDisplayMode;
 extern int SetViewModes(int dispmode, int scalemode, double scalefactor);
 extern double FracOfScreenSize();
 
+/* Everything that decides what size an image will be shown at.
+ * It's a snapshot of the globals, so it can be handed to
+ * a background thread without the globals changing under it.
+ */
+typedef struct {
+    int scaleMode;
+    double scaleRatio;
+    int monitorWidth, monitorHeight;
+    int screenWidth, screenHeight;    /* used by PHO_SCALE_FULLSCREEN */
+} PhoGeometry;
+
+extern void GetCurrentGeometry(PhoGeometry* geom);
+extern int SameGeometry(PhoGeometry* a, PhoGeometry* b);
+extern void CalcDisplaySize(int trueWidth, int trueHeight, int degrees,
+                            PhoGeometry* geom, int* width, int* height);
+
 /* ************** List maintenance functions ************** */
 extern void DeleteItem(PhoImage* item);
 extern void AppendItem(PhoImage* item);
@@ -144,8 +171,150 @@ extern void SetKeywordsDialogToggle(int which, int newval);
 /* Other routines that need to be public */
 extern void PrepareWindow();
 extern void DrawImage();
+extern void DrawSkipping(PhoImage* img, GdkPixbuf* pix);
 extern int ScaleAndRotate(PhoImage* img, int degrees);
 
+/* ************** Loading (imgload.c) ************** */
+extern GdkPixbuf* LoadPixbufForDisplay(char* filename, int degrees,
+                                       PhoGeometry* geom,
+                                       int* trueWidth, int* trueHeight,
+                                       GCancellable* cancel, GError** err);
+extern GdkPixbuf* LoadPixbufFromMap(char* filename, GMappedFile* map,
+                                    int degrees, PhoGeometry* geom,
+                                    int* trueWidth, int* trueHeight,
+                                    GCancellable* cancel, GError** err);
+extern GdkPixbuf* LoadPixbufFromBuffer(const guchar* data, gsize len,
+                                       int degrees, PhoGeometry* geom,
+                                       int* trueWidth, int* trueHeight,
+                                       GCancellable* cancel, GError** err);
+extern GdkPixbuf* LoadPixbufFromData(const guchar* data, gsize len,
+                                     GError** err);
+extern void CalcLoadSize(int width, int height, int degrees,
+                         PhoGeometry* geom, int* w, int* h);
+
+/* ************** Rotation (rotate.c) ************** */
+extern GdkPixbuf* RotatePixbuf(GdkPixbuf* pix, int degrees);
+extern void MirrorPixbuf(GdkPixbuf* pix);
+
+/* ************** Resampling (resample.c) ************** */
+#define RESAMPLE_NEAREST 0
+#define RESAMPLE_FAST    1    /* about like GDK_INTERP_BILINEAR */
+#define RESAMPLE_BEST    2    /* Lanczos3, or area for big reductions */
+#define RESAMPLE_LINEAR  0x10 /* add to any of them: filter in linear light */
+extern int gLinearLight;      /* add RESAMPLE_LINEAR when scaling to show */
+extern GdkPixbuf* ScaleRotatePixbuf(GdkPixbuf* src, int width, int height,
+                                    int degrees, int quality);
+
+/* ************** Adaptive interpolation (interp.c) ************** */
+extern GdkPixbuf* ScaleWithinBudget(GdkPixbuf* src, int width, int height,
+                                    int degrees, int hurry, int* draft);
+extern GdkPixbuf* ScaleBest(GdkPixbuf* src, int width, int height,
+                            int degrees);
+
+/* ************** Disk cache (diskcache.c) ************** */
+/* Decoded pixels of images that were slow to decode, kept in
+ * gDiskCacheDir (if set) up to gDiskCacheBytes.
+ */
+extern char* gDiskCacheDir;
+extern long gDiskCacheBytes;
+extern GdkPixbuf* DiskCacheLoad(char* filename, int degrees,
+                                PhoGeometry* geom,
+                                int* trueWidth, int* trueHeight);
+extern void DiskCacheSave(char* filename, GdkPixbuf* pix,
+                          int trueWidth, int trueHeight, gint64 decodeUsec);
+
+/* ************** Worker threads (workers.c) ************** */
+/* Priorities for background jobs, most urgent first */
+#define WORK_CURRENT    0
+#define WORK_NEXT       1
+#define WORK_PREV       2
+#define WORK_BACKGROUND 3
+
+typedef struct WorkJob_s WorkJob;
+typedef void (*WorkFunc)(gpointer data, GCancellable* cancel);
+typedef void (*WorkDoneFunc)(gpointer data);
+extern int StartWorkers();
+extern int SpareWorkers();
+extern WorkJob* QueueWork(int priority, WorkFunc func, WorkDoneFunc done,
+                          gpointer data);
+extern void CancelWork(WorkJob* job);
+
+/* ************** Prefetching (prefetch.c) ************** */
+/* Decode, scale and rotate the images next to gCurImage in the
+ * background, so that NextImage/PrevImage don't have to wait.
+ */
+extern void PrefetchNeighbors();
+extern int PrefetchNow(PhoImage* img, int rot, GSourceFunc notify);
+extern GdkPixbuf* PrefetchTake(PhoImage* img, PhoGeometry* geom, int wait,
+                               int* rot, int* trueWidth, int* trueHeight);
+extern void PrefetchForget(PhoImage* img);
+extern void PrefetchCancel();
+extern GdkPixbuf* DecodeForDisplay(char* filename, PhoGeometry* geom,
+                                   int wantRot, int* rot,
+                                   int* trueWidth, int* trueHeight,
+                                   GCancellable* cancel);
+
+/* ************** Progressive loading (progressive.c) ************** */
+typedef void (*ProgressiveDoneFunc)(PhoImage* img, GdkPixbuf* pix,
+                                    int trueWidth, int trueHeight);
+extern GdkPixbuf* ProgressiveStart(PhoImage* img, GMappedFile* map,
+                                   int rot, PhoGeometry* geom,
+                                   ProgressiveDoneFunc done,
+                                   int* trueWidth, int* trueHeight);
+extern void ProgressiveStop(PhoImage* img);
+
+/* ************** Thumbnail store (thumbstore.c) ************** */
+/* Sizes of the freedesktop.org "normal" and "large" thumbnails */
+#define THUMB_NORMAL 128
+#define THUMB_LARGE  256
+extern GdkPixbuf* ThumbnailLoad(char* filename, int size,
+                                int* trueWidth, int* trueHeight);
+extern int ThumbnailUpToDate(char* filename, int size);
+extern void ThumbnailSave(char* filename, GdkPixbuf* pix,
+                          int trueWidth, int trueHeight);
+
+/* ************** Directory scanning (scan.c) ************** */
+extern int gScanRecursive;
+extern void ScanDirectory(char* dirname);
+extern void StartScan();
+extern int ScanInProgress();
+extern void FindImageLoaders();
+extern int SniffImageData(const unsigned char* data, gsize len);
+extern int SniffImageFile(char* filename);
+
+/* ************** Grid mode (grid.c) ************** */
+extern void ToggleGridMode();
+extern void GridListChanged();
+extern void GridForget(PhoImage* img);
+
+/* ************** Header probing (probe.c) ************** */
+extern int ProbeImageSize(const unsigned char* data, gsize len,
+                          int* width, int* height);
+extern int ProbeImageFile(char* filename, int* width, int* height);
+
+/* ************** Background validation (validate.c) ************** */
+extern void StartValidator();
+extern void ValidateListChanged();
+extern void ValidateForget(PhoImage* img);
+
+/* ************** Tiled drawing (tiles.c) ************** */
+extern void DrawPixbufVisible(GdkDrawable* drawable, GdkGC* gc, GdkGC* bgGC,
+                              GdkPixbuf* pix, int dstX, int dstY,
+                              int visX, int visY, int visW, int visH);
+extern void ForgetTiles();
+
+/* ************** Image cache (imgcache.c) ************** */
+/* Recently shown pixbufs, ready to display, up to gCacheBytes total */
+extern long gCacheBytes;
+/* and those pushed out of it, compressed, up to gPackedCacheBytes */
+extern long gPackedCacheBytes;
+extern GdkPixbuf* CacheLookup(char* filename, int rot, PhoGeometry* geom,
+                              int* trueWidth, int* trueHeight);
+extern void CachePut(char* filename, int rot, int trueWidth, int trueHeight,
+                     GdkPixbuf* pix);
+extern void CacheForget(char* filename);
+extern long ParseByteSize(char* str);
+
 extern PhoImage* AddImage(char* filename);
 extern void DeleteImage(PhoImage* img);
 extern void ClearImageList();
@@ -160,6 +329,9 @@ extern int NextImage();
 extern int PrevImage();
 extern int ThisImage();
 extern int ShowImage();
+extern int SkipImages(int dir, guint32 time);
+extern void FinishSkipping();
+extern void SkipForget(PhoImage* img);
 
 extern void ToggleNoteFlag(PhoImage* img, int note);
 extern void InitNotes();
@@ -23,6 +23,11 @@
  */
 static void FreePhoImage(PhoImage* img)
 {
+    PrefetchForget(img);
+    ProgressiveStop(img);
+    GridForget(img);
+    ValidateForget(img);
+    SkipForget(img);
     if (img->comment) free(img->comment);
     free(img);
 }
@@ -73,6 +78,8 @@ void AppendItem(PhoImage* item)
 
     if (!item)
         return;
+    GridListChanged();
+    ValidateListChanged();
 
     /* Is the list empty? */
     if (gFirstImage == 0) {
@@ -0,0 +1,487 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * prefetch.c: decode neighboring images in the background,
+ * for pho, an image viewer.
+ *
+ * Copyright 2016 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+/* Decoding a big camera JPEG can take most of a second, and pho used
+ * to do that on every keypress. Instead, while the user is looking at
+ * gCurImage, the worker threads decode, scale and rotate the next and
+ * previous images for the current geometry. NextImage/PrevImage can
+ * then just take the finished pixbuf with PrefetchTake().
+ *
+ * The workers can also be asked to decode gCurImage itself, with
+ * PrefetchNow(), while pho shows a quick preview; the main loop is
+ * then told when the real image is ready.
+ *
+ * Each slot that needs doing queues a job with the workers, at the
+ * slot's priority, and the image ahead in the direction the user has
+ * been going counts as next. A job takes whichever slot is most
+ * urgent when it gets to run, since priorities change as the user
+ * moves.
+ *
+ * The workers never touch a PhoImage or any gtk state: each slot
+ * carries its own copy of the filename and of the geometry, and the
+ * PhoImage pointer is only used by the main thread to match slots.
+ */
+
+#include "pho.h"
+#include "exif/phoexif.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+
+/* One slot for an image the user is waiting for,
+ * one for the next image and one for the previous.
+ */
+#define NUM_SLOTS 3
+
+#define SLOT_EMPTY   0
+#define SLOT_PENDING 1    /* waiting for a worker */
+#define SLOT_BUSY    2    /* a worker is decoding it now */
+#define SLOT_READY   3
+#define SLOT_FAILED  4
+
+typedef struct {
+    int state;
+    int serial;           /* bumped whenever the slot is reassigned */
+    int priority;         /* lower goes first */
+    PhoImage* img;        /* only for matching: workers never use it */
+    char* filename;
+    PhoGeometry geom;
+    int wantRot;          /* -1 means use the EXIF orientation */
+    GSourceFunc notify;   /* idle callback for when it's done, or 0 */
+    GCancellable* cancel; /* stops the decode if the slot's cleared */
+
+    /* Results, valid when state is SLOT_READY: */
+    GdkPixbuf* pixbuf;    /* already scaled and rotated */
+    int rot;              /* rotation that was applied to pixbuf */
+    int trueWidth, trueHeight;    /* size of the unrotated original */
+} PrefetchSlot;
+
+static PrefetchSlot sSlots[NUM_SLOTS];
+static GMutex sLock;
+static GCond sCond;
+static int sStarted = 0;      /* have there ever been any slots? */
+
+/* Which way the user has been going. sLastImage is only compared,
+ * never followed.
+ */
+static PhoImage* sLastImage = 0;
+static int sBackward = 0;
+
+/* Set by PrefetchNow() */
+static PhoImage* sWanted = 0;
+static int sWantedRot = 0;
+static GSourceFunc sWantedNotify = 0;
+
+/* Decode filename and make it ready to display in geometry geom,
+ * rotated by wantRot (-1 for the EXIF orientation); *rot says which
+ * rotation was applied. cancel, if not 0, can stop it partway.
+ * Returns a new pixbuf, or 0.
+ * This runs in background threads, so it leaves the image list alone;
+ * the only globals it reads are gLinearLight and gDebug, which are
+ * set at startup.
+ */
+GdkPixbuf* DecodeForDisplay(char* filename, PhoGeometry* geom,
+                            int wantRot, int* rot,
+                            int* trueWidth, int* trueHeight,
+                            GCancellable* cancel)
+{
+    GdkPixbuf* pix;
+    GdkPixbuf* newpix;
+    int new_width, new_height;
+    int exifRotated = 0;
+
+    pix = LoadPixbufForDisplay(filename, wantRot, geom,
+                               trueWidth, trueHeight, cancel, NULL);
+    if (!pix)
+        return 0;
+
+    /* We can't use jhead from this thread: it keeps its results
+     * in globals. But gdk-pixbuf parses the orientation tag too.
+     * If we didn't know the rotation, the loader made the image big
+     * enough for either orientation, and we'll scale it down below.
+     */
+    if (wantRot < 0) {
+        const gchar* orient = gdk_pixbuf_get_option(pix, "orientation");
+        wantRot = orient ? ExifOrientationRot(atoi(orient)) : 0;
+        exifRotated = 1;
+    }
+    *rot = wantRot;
+
+    CalcDisplaySize(*trueWidth, *trueHeight, wantRot, geom,
+                    &new_width, &new_height);
+    if (new_width != gdk_pixbuf_get_width(pix)
+        || new_height != gdk_pixbuf_get_height(pix)) {
+        /* Scale and rotate in one pass */
+        newpix = ScaleRotatePixbuf(pix, new_width, new_height, wantRot,
+                                   RESAMPLE_BEST
+                                   | (gLinearLight ? RESAMPLE_LINEAR : 0));
+        g_object_unref(pix);
+        if (!newpix)
+            return 0;
+        pix = newpix;
+    }
+    else if (wantRot != 0) {
+        newpix = RotatePixbuf(pix, wantRot);
+        g_object_unref(pix);
+        pix = newpix;
+    }
+
+    /* While we have it decoded and in its EXIF orientation,
+     * a thumbnail costs next to nothing.
+     */
+    if (pix && exifRotated && !ThumbnailUpToDate(filename, THUMB_LARGE))
+        ThumbnailSave(filename, pix, *trueWidth, *trueHeight);
+
+    return pix;
+}
+
+/* Empty a slot, cancelling whatever it was doing.
+ * Call with sLock held.
+ */
+static void ClearSlot(PrefetchSlot* slot)
+{
+    if (slot->pixbuf)
+        g_object_unref(slot->pixbuf);
+    slot->pixbuf = 0;
+    g_free(slot->filename);
+    slot->filename = 0;
+    slot->img = 0;
+    slot->notify = 0;
+    if (slot->cancel) {
+        g_cancellable_cancel(slot->cancel);
+        g_object_unref(slot->cancel);
+        slot->cancel = 0;
+    }
+    slot->state = SLOT_EMPTY;
+    ++slot->serial;
+}
+
+/* Does slot hold (or will it hold) img as wanted for this geometry?
+ * If either rotation is -1 (EXIF) it's close enough: the loader made
+ * the image big enough for any rotation, and the caller will rotate
+ * it the rest of the way.
+ */
+static int SlotMatches(PrefetchSlot* slot, PhoImage* img,
+                       PhoGeometry* geom, int wantRot)
+{
+    return (slot->state != SLOT_EMPTY && slot->img == img
+            && (slot->wantRot == wantRot || slot->wantRot < 0 || wantRot < 0)
+            && SameGeometry(&slot->geom, geom));
+}
+
+static PrefetchSlot* NextPendingSlot()
+{
+    PrefetchSlot* best = 0;
+    int i;
+    for (i=0; i<NUM_SLOTS; ++i)
+        if (sSlots[i].state == SLOT_PENDING
+            && (!best || sSlots[i].priority < best->priority))
+            best = sSlots + i;
+    return best;
+}
+
+/* Decode whichever slot is most urgent. Runs in a worker thread;
+ * one of these is queued for each slot that's made pending.
+ */
+static void PrefetchOne(gpointer data, GCancellable* unused)
+{
+    PrefetchSlot* slot;
+    PhoGeometry geom;
+    GdkPixbuf* pix;
+    GCancellable* cancel;
+    char* filename;
+    int serial, wantRot, rot, trueWidth, trueHeight;
+
+    g_mutex_lock(&sLock);
+    slot = NextPendingSlot();
+    if (!slot) {    /* cleared before we got to it */
+        g_mutex_unlock(&sLock);
+        return;
+    }
+
+    /* Copy the job, so the main thread can reassign the slot
+     * while we're working on it.
+     */
+    slot->state = SLOT_BUSY;
+    serial = slot->serial;
+    filename = g_strdup(slot->filename);
+    geom = slot->geom;
+    wantRot = slot->wantRot;
+    cancel = g_object_ref(slot->cancel);
+    g_mutex_unlock(&sLock);
+
+    if (gDebug)
+        printf("Prefetching %s\n", filename);
+    pix = DecodeForDisplay(filename, &geom, wantRot, &rot,
+                           &trueWidth, &trueHeight, cancel);
+    g_free(filename);
+    g_object_unref(cancel);
+
+    g_mutex_lock(&sLock);
+    if (slot->serial == serial) {
+        slot->pixbuf = pix;
+        slot->rot = rot;
+        slot->trueWidth = trueWidth;
+        slot->trueHeight = trueHeight;
+        slot->state = (pix ? SLOT_READY : SLOT_FAILED);
+        if (slot->notify) {
+            g_idle_add(slot->notify, 0);
+            slot->notify = 0;
+        }
+    }
+    else if (pix)    /* Nobody wants it any more */
+        g_object_unref(pix);
+
+    /* PrefetchTake may be waiting for this one */
+    g_cond_broadcast(&sCond);
+    g_mutex_unlock(&sLock);
+}
+
+/* Slot priorities are 0 for the image the user is waiting for,
+ * then the next, then the previous.
+ */
+static int WorkPriority(int priority)
+{
+    return (priority == 0) ? WORK_CURRENT
+        : (priority == 1) ? WORK_NEXT : WORK_PREV;
+}
+
+/* Queue up the images on either side of gCurImage.
+ * Call this whenever gCurImage or the view modes change.
+ */
+void PrefetchNeighbors()
+{
+    PhoImage* want[NUM_SLOTS];
+    int wantRot[NUM_SLOTS];
+    int keep[NUM_SLOTS];
+    PhoGeometry geom;
+    int i, j;
+
+    if (!gCurImage || StartWorkers() != 0)
+        return;
+    sStarted = 1;
+
+    if (gCurImage != sLastImage) {
+        if (sLastImage)
+            sBackward = (gCurImage->next == sLastImage
+                         && gCurImage->prev != sLastImage);
+        sLastImage = gCurImage;
+    }
+
+    /* What PrefetchNow() asked for goes first, if it's still current */
+    want[0] = (sWanted == gCurImage) ? sWanted : 0;
+
+    /* Same rules for the ends of the list as NextImage and PrevImage */
+    want[1] = gCurImage->next;
+    if (want[1] == gFirstImage && !gRepeat)
+        want[1] = 0;
+    want[2] = (gCurImage == gFirstImage) ? 0 : gCurImage->prev;
+    if (want[2] == want[1])
+        want[2] = 0;
+
+    /* Whichever way the user is going comes next */
+    if (sBackward) {
+        PhoImage* tmp = want[1];
+        want[1] = want[2];
+        want[2] = tmp;
+    }
+
+    GetCurrentGeometry(&geom);
+
+    for (i=0; i<NUM_SLOTS; ++i) {
+        keep[i] = 0;
+        if (i == 0) {
+            wantRot[i] = sWantedRot;
+            continue;
+        }
+        wantRot[i] = (want[i] && want[i]->trueWidth) ? want[i]->curRot : -1;
+
+        if (want[i] == gCurImage)
+            want[i] = 0;
+
+        /* No need to decode anything that's already in the cache */
+        else if (want[i] && want[i]->trueWidth) {
+            int w, h;
+            GdkPixbuf* pix = CacheLookup(want[i]->filename,
+                                         want[i]->curRot, &geom, &w, &h);
+            if (pix) {
+                g_object_unref(pix);
+                want[i] = 0;
+            }
+        }
+    }
+
+    g_mutex_lock(&sLock);
+
+    /* First keep any slots that already have what we want,
+     * even if they had it for a different reason.
+     */
+    for (i=0; i<NUM_SLOTS; ++i) {
+        if (!want[i]) continue;
+        for (j=0; j<NUM_SLOTS; ++j)
+            if (!keep[j] && SlotMatches(sSlots+j, want[i], &geom, wantRot[i])) {
+                keep[j] = 1;
+                sSlots[j].priority = i;
+                sSlots[j].notify = (i == 0) ? sWantedNotify : 0;
+                want[i] = 0;
+                break;
+            }
+    }
+
+    /* Then reuse the other slots for whatever's left */
+    for (i=0; i<NUM_SLOTS; ++i) {
+        if (!want[i]) continue;
+        for (j=0; j<NUM_SLOTS; ++j)
+            if (!keep[j]) {
+                PrefetchSlot* slot = sSlots + j;
+                ClearSlot(slot);
+                slot->img = want[i];
+                slot->filename = g_strdup(want[i]->filename);
+                slot->geom = geom;
+                slot->wantRot = wantRot[i];
+                slot->priority = i;
+                slot->notify = (i == 0) ? sWantedNotify : 0;
+                slot->cancel = g_cancellable_new();
+                slot->state = SLOT_PENDING;
+                keep[j] = 1;
+                break;
+            }
+    }
+
+    for (j=0; j<NUM_SLOTS; ++j)
+        if (!keep[j] && sSlots[j].state != SLOT_EMPTY)
+            ClearSlot(sSlots + j);
+
+    /* A slot that's already finished won't notify again */
+    if (sWantedNotify && sWanted == gCurImage)
+        for (j=0; j<NUM_SLOTS; ++j)
+            if (sSlots[j].notify && sSlots[j].state >= SLOT_READY) {
+                g_idle_add(sSlots[j].notify, 0);
+                sSlots[j].notify = 0;
+            }
+
+    g_cond_broadcast(&sCond);
+    g_mutex_unlock(&sLock);
+
+    /* One job per new slot; each will take the most urgent slot left */
+    for (i=0; i<NUM_SLOTS; ++i)
+        if (want[i])
+            QueueWork(WorkPriority(i), PrefetchOne, 0, 0);
+}
+
+/* Decode gCurImage, rotated by rot, ahead of everything else,
+ * and call notify from the main loop once it's ready (or has failed);
+ * notify can then get it with PrefetchTake().
+ * Returns -1 if there are no worker threads to do it.
+ */
+int PrefetchNow(PhoImage* img, int rot, GSourceFunc notify)
+{
+    if (!img || img != gCurImage || StartWorkers() != 0)
+        return -1;
+
+    sWanted = img;
+    sWantedRot = rot;
+    sWantedNotify = notify;
+    PrefetchNeighbors();
+    return 0;
+}
+
+/* If img has been prefetched for geometry geom, return the pixbuf
+ * (which now belongs to the caller). If a worker is in the middle
+ * of decoding it and wait is set, wait for it rather than starting over;
+ * if wait isn't set, leave the worker to it and return 0.
+ * On entry *rot is the rotation wanted, or -1 for the EXIF default;
+ * on return it's the rotation that was actually applied,
+ * which may not be the same.
+ * Returns 0 if img hasn't been prefetched.
+ */
+GdkPixbuf* PrefetchTake(PhoImage* img, PhoGeometry* geom, int wait,
+                        int* rot, int* trueWidth, int* trueHeight)
+{
+    GdkPixbuf* pix = 0;
+    PrefetchSlot* slot = 0;
+    int i, serial;
+
+    if (!sStarted)
+        return 0;
+
+    /* Whatever happens, the caller won't want it from PrefetchNow() again */
+    if (sWanted == img)
+        sWanted = 0;
+
+    g_mutex_lock(&sLock);
+    for (i=0; i<NUM_SLOTS; ++i)
+        if (SlotMatches(sSlots+i, img, geom, *rot)) {
+            slot = sSlots + i;
+            break;
+        }
+
+    if (slot && !wait && slot->state < SLOT_READY)
+        slot = 0;
+
+    if (slot) {
+        serial = slot->serial;
+        while (slot->state == SLOT_BUSY && slot->serial == serial)
+            g_cond_wait(&sCond, &sLock);
+
+        if (slot->serial == serial && slot->state == SLOT_READY) {
+            pix = slot->pixbuf;
+            slot->pixbuf = 0;
+            *rot = slot->rot;
+            *trueWidth = slot->trueWidth;
+            *trueHeight = slot->trueHeight;
+        }
+
+        /* Either we took it, or it wasn't started or it failed:
+         * the caller will load it, so the workers shouldn't.
+         */
+        if (slot->serial == serial)
+            ClearSlot(slot);
+    }
+    g_mutex_unlock(&sLock);
+
+    return pix;
+}
+
+/* img is going away: make sure no slot still refers to it. */
+void PrefetchForget(PhoImage* img)
+{
+    int i;
+
+    if (!sStarted)
+        return;
+
+    if (sWanted == img)
+        sWanted = 0;
+
+    g_mutex_lock(&sLock);
+    for (i=0; i<NUM_SLOTS; ++i)
+        if (sSlots[i].img == img)
+            ClearSlot(sSlots + i);
+    g_mutex_unlock(&sLock);
+}
+
+/* Drop everything queued for prefetching, and stop what's decoding:
+ * the user has gone somewhere else entirely.
+ */
+void PrefetchCancel()
+{
+    int i;
+
+    if (!sStarted)
+        return;
+
+    sWanted = 0;
+
+    g_mutex_lock(&sLock);
+    for (i=0; i<NUM_SLOTS; ++i)
+        if (sSlots[i].state != SLOT_EMPTY)
+            ClearSlot(sSlots + i);
+    g_mutex_unlock(&sLock);
+}
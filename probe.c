@@ -0,0 +1,214 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * probe.c: find an image's size from its header, for pho, an image viewer.
+ *
+ * Copyright 2016 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+/* Every format pho is likely to see says how big the image is within
+ * its first few hundred bytes (JPEG in its SOFn marker, after the
+ * EXIF), so there's no need to decode anything to find out.
+ * Knowing the size early lets pho size previews and the window
+ * before the pixels arrive.
+ *
+ * It only looks at the bytes it's handed, so the validator's
+ * worker threads can call it.
+ */
+
+#include "pho.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define BE16(p) (((p)[0] << 8) | (p)[1])
+#define LE16(p) (((p)[1] << 8) | (p)[0])
+#define BE32(p) (((guint32)(p)[0] << 24) | ((p)[1] << 16) \
+                 | ((p)[2] << 8) | (p)[3])
+#define LE32(p) (((guint32)(p)[3] << 24) | ((p)[2] << 16) \
+                 | ((p)[1] << 8) | (p)[0])
+
+/* Walk the JPEG markers to the frame header */
+static int ProbeJpeg(const unsigned char* data, gsize len, int* w, int* h)
+{
+    gsize pos = 2;
+    int marker;
+
+    while (pos + 4 <= len) {
+        if (data[pos] != 0xff)
+            return 0;
+        while (pos < len && data[pos] == 0xff)    /* fill bytes */
+            ++pos;
+        if (pos + 3 > len)
+            return 0;
+        marker = data[pos++];
+
+        if (marker == 0xd8 || marker == 0x01
+            || (marker >= 0xd0 && marker <= 0xd7))
+            continue;
+        if (marker == 0xd9 || marker == 0xda)    /* too late */
+            return 0;
+
+        /* SOF0 through SOF15, except DHT, JPG and DAC:
+         * length, precision, height, width.
+         */
+        if (marker >= 0xc0 && marker <= 0xcf
+            && marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+            if (pos + 7 > len)
+                return 0;
+            *h = BE16(data + pos + 3);
+            *w = BE16(data + pos + 5);
+            return 1;
+        }
+        pos += BE16(data + pos);
+    }
+    return 0;
+}
+
+/* ImageWidth and ImageLength from the first IFD */
+static int ProbeTiff(const unsigned char* data, gsize len, int* w, int* h)
+{
+    int little = (data[0] == 'I');
+    gsize ifd, entry;
+    int n, i;
+
+    *w = *h = 0;
+    if (len < 8)
+        return 0;
+    ifd = little ? LE32(data + 4) : BE32(data + 4);
+    if (ifd + 2 > len)
+        return 0;
+    n = little ? LE16(data + ifd) : BE16(data + ifd);
+
+    for (i = 0; i < n; ++i) {
+        int tag, type;
+        guint32 value;
+
+        entry = ifd + 2 + 12 * i;
+        if (entry + 12 > len)
+            break;
+        tag = little ? LE16(data + entry) : BE16(data + entry);
+        type = little ? LE16(data + entry + 2) : BE16(data + entry + 2);
+        if (type == 3)          /* SHORT */
+            value = little ? LE16(data + entry + 8) : BE16(data + entry + 8);
+        else if (type == 4)     /* LONG */
+            value = little ? LE32(data + entry + 8) : BE32(data + entry + 8);
+        else
+            continue;
+
+        if (tag == 256)
+            *w = value;
+        else if (tag == 257)
+            *h = value;
+    }
+    return (*w > 0 && *h > 0);
+}
+
+/* The three kinds of WebP: lossy, lossless and extended */
+static int ProbeWebp(const unsigned char* data, gsize len, int* w, int* h)
+{
+    const unsigned char* chunk = data + 12;
+
+    if (len < 30)
+        return 0;
+    if (!memcmp(chunk, "VP8 ", 4)) {
+        *w = LE16(data + 26) & 0x3fff;
+        *h = LE16(data + 28) & 0x3fff;
+        return 1;
+    }
+    if (!memcmp(chunk, "VP8L", 4)) {
+        const unsigned char* b = data + 21;
+        *w = 1 + (((b[1] & 0x3f) << 8) | b[0]);
+        *h = 1 + (((b[3] & 0x0f) << 10) | (b[2] << 2) | ((b[1] & 0xc0) >> 6));
+        return 1;
+    }
+    if (!memcmp(chunk, "VP8X", 4)) {
+        *w = 1 + (data[24] | (data[25] << 8) | (data[26] << 16));
+        *h = 1 + (data[27] | (data[28] << 8) | (data[29] << 16));
+        return 1;
+    }
+    return 0;
+}
+
+/* Read a decimal number from a PNM header, skipping space and comments */
+static int PnmNumber(const unsigned char* data, gsize len, gsize* pos)
+{
+    int n = 0;
+
+    while (*pos < len) {
+        if (data[*pos] == '#')
+            while (*pos < len && data[*pos] != '\n')
+                ++*pos;
+        else if (isspace(data[*pos]))
+            ++*pos;
+        else
+            break;
+    }
+    if (*pos >= len || !isdigit(data[*pos]))
+        return 0;
+    while (*pos < len && isdigit(data[*pos]) && n < 1000000)
+        n = n * 10 + (data[(*pos)++] - '0');
+    return n;
+}
+
+/* Find the size of the image whose file starts with data (len bytes,
+ * the whole file if possible: a JPEG's EXIF can run to 64k before the
+ * frame header). The size is as stored, before any EXIF rotation.
+ * Returns 1 if it could tell, 0 if not.
+ */
+int ProbeImageSize(const unsigned char* data, gsize len,
+                   int* width, int* height)
+{
+    int w = 0, h = 0, ok = 0;
+
+    if (len >= 4 && data[0] == 0xff && data[1] == 0xd8)
+        ok = ProbeJpeg(data, len, &w, &h);
+    else if (len >= 24 && !memcmp(data, "\211PNG", 4)) {
+        w = BE32(data + 16);
+        h = BE32(data + 20);
+        ok = !memcmp(data + 12, "IHDR", 4);
+    }
+    else if (len >= 10 && !memcmp(data, "GIF8", 4)) {
+        w = LE16(data + 6);
+        h = LE16(data + 8);
+        ok = 1;
+    }
+    else if (len >= 8 && (!memcmp(data, "II*\0", 4)
+                          || !memcmp(data, "MM\0*", 4)))
+        ok = ProbeTiff(data, len, &w, &h);
+    else if (len >= 16 && !memcmp(data, "RIFF", 4)
+             && !memcmp(data + 8, "WEBP", 4))
+        ok = ProbeWebp(data, len, &w, &h);
+    else if (len >= 26 && data[0] == 'B' && data[1] == 'M') {
+        w = (gint32)LE32(data + 18);
+        h = abs((gint32)LE32(data + 22));    /* negative is top down */
+        ok = 1;
+    }
+    else if (len >= 3 && data[0] == 'P' && data[1] >= '1' && data[1] <= '6') {
+        gsize pos = 2;
+        w = PnmNumber(data, len, &pos);
+        h = PnmNumber(data, len, &pos);
+        ok = 1;
+    }
+
+    if (!ok || w <= 0 || h <= 0)
+        return 0;
+    *width = w;
+    *height = h;
+    return 1;
+}
+
+/* ProbeImageSize for a file. Only the pages of the header get read. */
+int ProbeImageFile(char* filename, int* width, int* height)
+{
+    GMappedFile* map = g_mapped_file_new(filename, FALSE, NULL);
+    int ok;
+
+    if (!map)
+        return 0;
+    ok = ProbeImageSize((const unsigned char*)g_mapped_file_get_contents(map),
+                        g_mapped_file_get_length(map), width, height);
+    g_mapped_file_unref(map);
+    return ok;
+}
@@ -0,0 +1,422 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * progressive.c: show big images while they're still loading,
+ * for pho, an image viewer.
+ *
+ * Copyright 2016 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+/* A big PNG or progressive JPEG on a slow disk can take seconds to
+ * read, and pho used to sit there frozen until the last byte arrived.
+ * Instead, this feeds the (mapped) file to a GdkPixbufLoader a chunk
+ * at a time from an idle handler, so events still get handled, and
+ * each chunk only gets paged in when it's needed. It paints the
+ * parts the loader says are done ("area-updated") into a pixbuf of the
+ * size that will be shown. That pixbuf is shown as a preview until
+ * the whole image is loaded.
+ *
+ * The loader only sends area-updated when it isn't scaling the image
+ * itself, so this always decodes at full size and does the scaling
+ * (and mirroring and rotating) a piece at a time. That's only worth it
+ * for images that would be decoded at full size anyway, PNG and GIF,
+ * and for progressive JPEGs, which show the whole picture early;
+ * ordinary JPEGs decode faster scaled down (imgload.c). Other loaders
+ * (TIFF's, for one) don't say anything until they've read the whole
+ * file, so they're left to the ordinary loader too, and so is
+ * anything that hasn't said how big it is within the first few
+ * chunks.
+ *
+ * Only one image loads this way at a time, from the main thread.
+ */
+
+#include "pho.h"
+#include "exif/phoexif.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+/* Smaller files than this load quickly enough the ordinary way */
+#define PROGRESSIVE_MIN_BYTES (1024 * 1024)
+
+#define PROGRESSIVE_CHUNK 65536
+
+/* How much to read, on the main thread, to find out how big it is */
+#define PROGRESSIVE_MAX_HEADER_CHUNKS 4
+
+typedef struct {
+    PhoImage* img;
+    GMappedFile* map;
+    const guchar* data;
+    gsize len, pos;
+    GdkPixbufLoader* loader;
+    GdkPixbuf* src;          /* the loader's pixbuf: we don't own it */
+    GdkPixbuf* display;      /* what we show meanwhile, scaled and rotated */
+    int rot;
+    int mirror;              /* EXIF says to mirror it, before rotating */
+    double xscale, yscale;
+    int dispWidth, dispHeight;    /* size of display before rotation */
+    int trueWidth, trueHeight;
+    int dirtyX0, dirtyY0, dirtyX1, dirtyY1;    /* in src coordinates */
+    guint idleID;
+    gint64 started;          /* for deciding on the disk cache */
+    ProgressiveDoneFunc done;
+} ProgressiveState;
+
+static ProgressiveState sLoad;
+
+/* Is the JPEG in data, len bytes long, progressive? Its frame
+ * header says, after whatever EXIF and other segments come first.
+ */
+static int IsProgressiveJpeg(const guchar* data, gsize len)
+{
+    gsize pos = 2;
+
+    while (pos + 4 <= len && data[pos] == 0xff) {
+        int marker = data[pos+1];
+
+        if (marker == 0xff) {    /* padding */
+            ++pos;
+            continue;
+        }
+        /* SOF0 to SOF15, except DHT, JPG and DAC */
+        if (marker >= 0xc0 && marker <= 0xcf
+            && marker != 0xc4 && marker != 0xc8 && marker != 0xcc)
+            return (marker & 3) == 2;    /* SOF2, 6, 10, 14 */
+        if (marker == 0xda || marker == 0xd9)
+            return 0;
+        pos += 2 + ((data[pos+2] << 8) | data[pos+3]);
+    }
+    return 0;
+}
+
+/* Is the image in data, len bytes long, worth loading a piece
+ * at a time?
+ */
+static int WorthStreaming(const guchar* data, gsize len)
+{
+    if (len < 8)
+        return 0;
+    if (!memcmp(data, "\211PNG", 4) || !memcmp(data, "GIF8", 4))
+        return 1;
+    if (data[0] == 0xff && data[1] == 0xd8)
+        return IsProgressiveJpeg(data, len);
+    return 0;
+}
+
+static void AreaPrepared(GdkPixbufLoader* loader, gpointer data)
+{
+    sLoad.src = gdk_pixbuf_loader_get_pixbuf(loader);
+}
+
+static void AreaUpdated(GdkPixbufLoader* loader,
+                        gint x, gint y, gint width, gint height,
+                        gpointer data)
+{
+    if (sLoad.dirtyX1 <= sLoad.dirtyX0) {
+        sLoad.dirtyX0 = x;
+        sLoad.dirtyY0 = y;
+        sLoad.dirtyX1 = x + width;
+        sLoad.dirtyY1 = y + height;
+        return;
+    }
+    if (x < sLoad.dirtyX0) sLoad.dirtyX0 = x;
+    if (y < sLoad.dirtyY0) sLoad.dirtyY0 = y;
+    if (x + width > sLoad.dirtyX1) sLoad.dirtyX1 = x + width;
+    if (y + height > sLoad.dirtyY1) sLoad.dirtyY1 = y + height;
+}
+
+/* Scale whatever the loader has finished since last time into
+ * sLoad.display, and redraw if that's what's on the screen.
+ */
+static void PaintDirty()
+{
+    int x0, y0, x1, y1, w, h;
+    GdkPixbuf* piece;
+
+    if (!sLoad.src || !sLoad.display || sLoad.dirtyX1 <= sLoad.dirtyX0)
+        return;
+
+    x0 = floor(sLoad.dirtyX0 * sLoad.xscale);
+    y0 = floor(sLoad.dirtyY0 * sLoad.yscale);
+    x1 = ceil(sLoad.dirtyX1 * sLoad.xscale);
+    y1 = ceil(sLoad.dirtyY1 * sLoad.yscale);
+    if (x1 > sLoad.dispWidth) x1 = sLoad.dispWidth;
+    if (y1 > sLoad.dispHeight) y1 = sLoad.dispHeight;
+    sLoad.dirtyX1 = sLoad.dirtyX0 = 0;
+
+    w = x1 - x0;
+    h = y1 - y0;
+    if (w <= 0 || h <= 0)
+        return;
+
+    piece = gdk_pixbuf_new(GDK_COLORSPACE_RGB,
+                           gdk_pixbuf_get_has_alpha(sLoad.src), 8, w, h);
+    if (!piece)
+        return;
+    gdk_pixbuf_scale(sLoad.src, piece, 0, 0, w, h,
+                     -x0, -y0, sLoad.xscale, sLoad.yscale,
+                     GDK_INTERP_BILINEAR);
+
+    /* Mirrored back, as imgload.c does to whole images */
+    if (sLoad.mirror) {
+        int newx0 = sLoad.dispWidth - x1;
+        MirrorPixbuf(piece);
+        x1 = sLoad.dispWidth - x0;
+        x0 = newx0;
+    }
+
+    /* Same mapping as RotatePixbuf, for a rectangle */
+    if (sLoad.rot != 0) {
+        GdkPixbuf* rotated = RotatePixbuf(piece, sLoad.rot);
+        int newx, newy;
+        g_object_unref(piece);
+        if (!rotated)
+            return;
+        piece = rotated;
+        switch (sLoad.rot) {
+          case 90:
+              newx = sLoad.dispHeight - y1;
+              newy = x0;
+              break;
+          case 270:
+              newx = y0;
+              newy = sLoad.dispWidth - x1;
+              break;
+          default:    /* 180 */
+              newx = sLoad.dispWidth - x1;
+              newy = sLoad.dispHeight - y1;
+              break;
+        }
+        x0 = newx;
+        y0 = newy;
+    }
+
+    gdk_pixbuf_copy_area(piece, 0, 0,
+                         gdk_pixbuf_get_width(piece),
+                         gdk_pixbuf_get_height(piece),
+                         sLoad.display, x0, y0);
+    g_object_unref(piece);
+
+    /* The user may have rotated or zoomed the preview,
+     * in which case it's not ours to draw on any more.
+     */
+    if (gImage == sLoad.display) {
+        ForgetTiles();    /* we changed its pixels behind their back */
+        DrawImage();
+    }
+}
+
+/* Free everything; the idle handler must already be gone.
+ * Returns the loader's pixbuf, with a new reference, if finished is set
+ * and it loaded properly.
+ */
+static GdkPixbuf* EndLoad(int finished)
+{
+    GdkPixbuf* pix = 0;
+    GError* err = NULL;
+
+    if (sLoad.map)
+        g_mapped_file_unref(sLoad.map);
+
+    if (sLoad.loader) {
+        if (!finished)
+            gdk_pixbuf_loader_close(sLoad.loader, NULL);
+        else if (gdk_pixbuf_loader_close(sLoad.loader, &err)) {
+            pix = gdk_pixbuf_loader_get_pixbuf(sLoad.loader);
+            if (pix) {
+                g_object_ref(pix);
+                if (sLoad.mirror)
+                    MirrorPixbuf(pix);
+            }
+        }
+        else {
+            fprintf(stderr, "Can't open %s: %s\n", sLoad.img->filename,
+                    err ? err->message : "unknown error");
+            if (err)
+                g_error_free(err);
+        }
+        g_object_unref(sLoad.loader);
+    }
+
+    if (sLoad.display)
+        g_object_unref(sLoad.display);
+
+    memset(&sLoad, 0, sizeof sLoad);
+    return pix;
+}
+
+/* Feed the loader one chunk of the file. Returns 0 when there's
+ * nothing more to do, either because it's all read or on an error.
+ */
+static int FeedChunk(GError** err)
+{
+    gsize n = sLoad.len - sLoad.pos;
+
+    if (n == 0)
+        return 0;
+    if (n > PROGRESSIVE_CHUNK)
+        n = PROGRESSIVE_CHUNK;
+    sLoad.pos += n;
+    return gdk_pixbuf_loader_write(sLoad.loader, sLoad.data + sLoad.pos - n,
+                                   n, err);
+}
+
+static gboolean FeedMore(gpointer data)
+{
+    GError* err = NULL;
+    PhoImage* img = sLoad.img;
+    ProgressiveDoneFunc done = sLoad.done;
+    int trueWidth = sLoad.trueWidth;
+    int trueHeight = sLoad.trueHeight;
+    gint64 started = sLoad.started;
+    GdkPixbuf* pix;
+
+    if (FeedChunk(&err)) {
+        PaintDirty();
+        return TRUE;
+    }
+
+    /* All read, or failed */
+    sLoad.idleID = 0;
+    if (err) {
+        fprintf(stderr, "Can't open %s: %s\n", img->filename, err->message);
+        g_error_free(err);
+        pix = EndLoad(0);
+    }
+    else
+        pix = EndLoad(1);
+
+    if (pix)
+        DiskCacheSave(img->filename, pix, trueWidth, trueHeight,
+                      g_get_monotonic_time() - started);
+
+    if (gDebug)
+        printf("Finished progressive load of %s\n", img->filename);
+    (*done)(img, pix, trueWidth, trueHeight);
+    return FALSE;
+}
+
+/* Start loading img progressively from map, which has the contents
+ * of its file, if it's big enough to be worth it.
+ * Returns a new pixbuf to show meanwhile, already scaled for geometry
+ * geom and rotated by rot (it will fill in as the image loads),
+ * and the unrotated size of the original in *trueWidth and *trueHeight.
+ * done will be called from the main loop when it's finished,
+ * with a new reference to the full-size, unrotated pixbuf, mirrored
+ * back if need be (or 0 if it couldn't be loaded).
+ * Returns 0 if img won't be loaded progressively.
+ */
+GdkPixbuf* ProgressiveStart(PhoImage* img, GMappedFile* map,
+                            int rot, PhoGeometry* geom,
+                            ProgressiveDoneFunc done,
+                            int* trueWidth, int* trueHeight)
+{
+    GdkPixbuf* cached;
+    const gchar* orient;
+    int w, h, chunks;
+    int ok = 1;
+
+    ProgressiveStop(0);
+
+    if (!map || g_mapped_file_get_length(map) < PROGRESSIVE_MIN_BYTES
+        || !WorthStreaming((guchar*)g_mapped_file_get_contents(map),
+                           g_mapped_file_get_length(map)))
+        return 0;
+
+    /* Already decoded in the disk cache? Then it won't take long. */
+    cached = DiskCacheLoad(img->filename, rot, geom, &w, &h);
+    if (cached) {
+        g_object_unref(cached);
+        return 0;
+    }
+
+    /* Reading it a page at a time is what makes it progressive */
+    sLoad.map = g_mapped_file_ref(map);
+    sLoad.data = (guchar*)g_mapped_file_get_contents(map);
+    sLoad.len = g_mapped_file_get_length(map);
+    sLoad.pos = 0;
+    sLoad.img = img;
+    sLoad.rot = rot;
+    sLoad.done = done;
+    sLoad.started = g_get_monotonic_time();
+
+    sLoad.loader = gdk_pixbuf_loader_new();
+    g_signal_connect(G_OBJECT(sLoad.loader), "area-prepared",
+                     G_CALLBACK(AreaPrepared), 0);
+    g_signal_connect(G_OBJECT(sLoad.loader), "area-updated",
+                     G_CALLBACK(AreaUpdated), 0);
+
+    /* Read until we know how big it is, but not the whole file:
+     * this is the main thread.
+     */
+    for (chunks = 0; !sLoad.src && ok
+                     && chunks < PROGRESSIVE_MAX_HEADER_CHUNKS; ++chunks)
+        ok = FeedChunk(NULL);
+    if (!sLoad.src) {
+        /* Either it's broken, or the loader for this format doesn't
+         * do incremental loading. Let the ordinary loader sort it out.
+         */
+        EndLoad(0);
+        return 0;
+    }
+
+    /* The loader knows the orientation by the time it has a pixbuf */
+    orient = gdk_pixbuf_get_option(sLoad.src, "orientation");
+    sLoad.mirror = orient && ExifOrientationMirror(atoi(orient));
+
+    sLoad.trueWidth = gdk_pixbuf_get_width(sLoad.src);
+    sLoad.trueHeight = gdk_pixbuf_get_height(sLoad.src);
+    CalcDisplaySize(sLoad.trueWidth, sLoad.trueHeight, rot, geom, &w, &h);
+    if (w < 1 || h < 1) {
+        EndLoad(0);
+        return 0;
+    }
+    sLoad.dispWidth = w;
+    sLoad.dispHeight = h;
+    sLoad.xscale = (double)w / sLoad.trueWidth;
+    sLoad.yscale = (double)h / sLoad.trueHeight;
+
+    if (rot % 180 != 0)
+        sLoad.display = gdk_pixbuf_new(GDK_COLORSPACE_RGB,
+                                       gdk_pixbuf_get_has_alpha(sLoad.src),
+                                       8, h, w);
+    else
+        sLoad.display = gdk_pixbuf_new(GDK_COLORSPACE_RGB,
+                                       gdk_pixbuf_get_has_alpha(sLoad.src),
+                                       8, w, h);
+    if (!sLoad.display) {
+        EndLoad(0);
+        return 0;
+    }
+    gdk_pixbuf_fill(sLoad.display, 0x000000ff);
+    PaintDirty();
+
+    /* Let keypresses and redraws go ahead of us */
+    sLoad.idleID = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE, FeedMore, 0, 0);
+
+    if (gDebug)
+        printf("Loading %s progressively\n", img->filename);
+
+    *trueWidth = sLoad.trueWidth;
+    *trueHeight = sLoad.trueHeight;
+    return g_object_ref(sLoad.display);
+}
+
+/* Stop loading img, or whatever's loading if img is 0.
+ * Its done function won't be called.
+ */
+void ProgressiveStop(PhoImage* img)
+{
+    if (!sLoad.img || (img && img != sLoad.img))
+        return;
+
+    if (gDebug)
+        printf("Abandoning progressive load of %s\n", sLoad.img->filename);
+    if (sLoad.idleID)
+        g_source_remove(sLoad.idleID);
+    sLoad.idleID = 0;
+    EndLoad(0);
+}
@@ -0,0 +1,826 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * resample.c: pho's own scaler, which can rotate at the same time,
+ * for pho, an image viewer.
+ *
+ * Copyright 2016 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+/* gdk_pixbuf_scale_simple() uses one core, and at big reductions
+ * (a 45 megapixel frame shrunk to fit a 1920x1080 window is close to
+ * 1/5) GDK_INTERP_BILINEAR aliases badly, while GDK_INTERP_HYPER is
+ * very slow. So pho has its own.
+ *
+ * The filter is separable. Each source row that's needed is filtered
+ * horizontally, once, into a small ring of rows; each output row is
+ * then a weighted sum of some of those. It's written as a row, a
+ * column, or a row backwards into the destination, depending on the
+ * rotation, so rotating costs next to nothing: there's no scaled but
+ * unrotated copy to make and then copy again.
+ *
+ * The filters, by quality:
+ *   RESAMPLE_BEST:    averages the source pixels each output pixel
+ *                     covers (area) when shrinking to less than
+ *                     1/AREA_MIN_SCALE, where that's as good as
+ *                     anything; Lanczos3 otherwise.
+ *   RESAMPLE_FAST:    area when shrinking, linear between the nearest
+ *                     two source pixels (tent) when enlarging.
+ *                     Much the same as GDK_INTERP_BILINEAR.
+ *   RESAMPLE_NEAREST: just the nearest source pixel.
+ *
+ * Averaging sRGB values directly makes fine detail and high contrast
+ * edges come out darker than they should, which matters when you're
+ * trying to tell which of a few shots is sharpest. With
+ * RESAMPLE_LINEAR added to the quality, each source row is first
+ * turned into linear light, LINEAR_BITS bits per value, through a
+ * table, and split into one plane per channel; each plane is filtered
+ * with the weights for several taps multiplied at once; and the
+ * results go back to sRGB through another table at the end. Alpha is
+ * scaled but not gamma-converted, and the color is premultiplied by
+ * it in linear light. Which callers ask for linear light depends
+ * on gLinearLight, set with -l and -L.
+ *
+ * Weights are fixed point, WEIGHT_BITS bits, and the horizontally
+ * filtered rows keep EXTRA_BITS more bits than the source, so nothing
+ * is rounded until the end. Lanczos can overshoot, so that stops short
+ * of what would fill the 16 bits. Linear values have enough bits of
+ * their own to need no extra. The weighted sums are done four or
+ * eight at a time with SSE2 where there is any.
+ *
+ * Big images are split into horizontal strips of output, each with its
+ * own ring: one for the calling thread, and one for each worker thread
+ * (workers.c) that's free to help, up to MAX_STRIPS. The caller takes
+ * strips too, so none waits on a worker that hasn't got to it yet.
+ * Scales that are already running in a worker aren't split, since the
+ * other workers have jobs of their own. The only thing the strips
+ * share is the source, and which source pixels go into which output
+ * pixel, which is worked out beforehand.
+ *
+ * RGBA is filtered with the color premultiplied by alpha, or the
+ * color of transparent pixels, which could be anything, would bleed
+ * into the opaque ones next to them. It's divided out again from the
+ * full precision sums, so opaque images come out exactly as before.
+ *
+ * The linear light tables are built the first time they're needed,
+ * under g_once, and never change after that. gLinearLight is defined
+ * here but only read by the callers, which pass RESAMPLE_LINEAR.
+ */
+
+#include "pho.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__GNUC__) && defined(__SSE2__) \
+    && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#include <emmintrin.h>
+#endif
+
+#define WEIGHT_BITS 14
+#define EXTRA_BITS 6
+#define LINEAR_BITS 14
+#define LINEAR_MAX ((1 << LINEAR_BITS) - 1)
+
+/* Whether scaling for display should be done in linear light.
+ * Set with -l and -L; only at startup, so any thread can read it.
+ */
+int gLinearLight = 1;
+
+/* Shrinking further than this, RESAMPLE_BEST averages */
+#define AREA_MIN_SCALE 3.
+
+/* Lanczos3 looks this many source pixels (or output pixels, when
+ * shrinking) either side.
+ */
+#define LANCZOS_SUPPORT 3.
+
+/* Split up: at most this many strips, none of them less than
+ * MIN_STRIP_ROWS rows, and none at all for less than
+ * MIN_THREADED_PIXELS pixels read and written.
+ */
+#define MAX_STRIPS 8
+#define MIN_STRIP_ROWS 32
+#define MIN_THREADED_PIXELS 1000000
+
+/* Each filtered row is padded by this many values, since the SSE2
+ * kernel writes a little past the end of a 3-channel row.
+ */
+#define ROW_PAD 4
+
+/* Weights, and linear planes, are padded with zeroes to a multiple
+ * of this, so the planar kernel can always take TAP_ALIGN at a time.
+ */
+#define TAP_ALIGN 8
+
+/* The source pixels that go into one output pixel, along one axis */
+typedef struct {
+    int first;          /* first source pixel */
+    int n;              /* how many */
+    gint16* weights;    /* n of them, adding up to 1 << WEIGHT_BITS,
+                         * then zeroes to a multiple of TAP_ALIGN */
+} Contrib;
+
+/* One strip's share of the work */
+typedef struct {
+    GdkPixbuf* src;
+    guchar* dstPixels;
+    int dstStride;
+    int width, height, degrees;
+    Contrib* xc;
+    Contrib* yc;
+    int ringSize;
+    int linear;         /* filter in linear light */
+    int y0, y1;         /* output rows, before rotating */
+    int ok;
+} Strip;
+
+/* The strips of one scale, shared by the thread that wants it and any
+ * workers helping out. Whoever lets go of it last frees it.
+ */
+typedef struct {
+    Strip strips[MAX_STRIPS];
+    int nstrips;
+    gint next;          /* the next strip nobody has taken */
+    int left;           /* strips not finished yet, under lock */
+    gint refs;
+    GMutex lock;
+    GCond finished;
+} StripSet;
+
+/* sRGB to linear light and back, for colors; and the same range
+ * conversion without the gamma, for alpha.
+ */
+static guint16 sToLinear[256];
+static guint16 sAlphaToLinear[256];
+static guchar sFromLinear[LINEAR_MAX + 1];
+static guchar sAlphaFromLinear[LINEAR_MAX + 1];
+
+static void MakeLinearTables()
+{
+    static gsize sDone = 0;
+    int i;
+
+    if (!g_once_init_enter(&sDone))
+        return;
+
+    for (i = 0; i < 256; ++i) {
+        double v = i / 255.;
+        v = (v <= .04045) ? v / 12.92 : pow((v + .055) / 1.055, 2.4);
+        sToLinear[i] = (guint16)floor(v * LINEAR_MAX + .5);
+        sAlphaToLinear[i] = (guint16)((i * LINEAR_MAX + 127) / 255);
+    }
+    for (i = 0; i <= LINEAR_MAX; ++i) {
+        double v = (double)i / LINEAR_MAX;
+        v = (v <= .0031308) ? v * 12.92 : 1.055 * pow(v, 1 / 2.4) - .055;
+        sFromLinear[i] = (guchar)floor(v * 255. + .5);
+        sAlphaFromLinear[i] = (guchar)((i * 255 + LINEAR_MAX / 2)
+                                       / LINEAR_MAX);
+    }
+    g_once_init_leave(&sDone, 1);
+}
+
+static double Sinc(double x)
+{
+    if (x == 0.)
+        return 1.;
+    x *= G_PI;
+    return sin(x) / x;
+}
+
+static double Lanczos3(double x)
+{
+    if (x <= -LANCZOS_SUPPORT || x >= LANCZOS_SUPPORT)
+        return 0.;
+    return Sinc(x) * Sinc(x / LANCZOS_SUPPORT);
+}
+
+/* Work out which source pixels, and how much of each, go into each of
+ * dstLen output pixels along an axis srcLen pixels long.
+ * Returns an array of dstLen, or 0 if out of memory.
+ */
+static Contrib* MakeContribs(int srcLen, int dstLen, int quality)
+{
+    double scale = (double)srcLen / dstLen;
+    double stretch = MAX(scale, 1.);    /* how wide the filter is */
+    int area = (scale > 1. && (quality == RESAMPLE_FAST
+                               || scale >= AREA_MIN_SCALE));
+    int maxTaps;
+    Contrib* contribs;
+    gint16* weights;
+    double* w;
+    int i, j;
+
+    if (quality == RESAMPLE_NEAREST)
+        maxTaps = 1;
+    else if (area)
+        maxTaps = (int)ceil(scale) + 1;
+    else if (quality == RESAMPLE_BEST)
+        maxTaps = 2 * (int)ceil(LANCZOS_SUPPORT * stretch) + 1;
+    else
+        maxTaps = 2;
+
+    maxTaps = (maxTaps + TAP_ALIGN - 1) / TAP_ALIGN * TAP_ALIGN;
+    contribs = malloc(dstLen * sizeof (Contrib));
+    weights = calloc((size_t)dstLen * maxTaps, sizeof (gint16));
+    w = malloc(maxTaps * sizeof (double));
+    if (!contribs || !weights || !w) {
+        free(contribs);
+        free(weights);
+        free(w);
+        return 0;
+    }
+
+    for (i = 0; i < dstLen; ++i) {
+        Contrib* c = contribs + i;
+        double center = (i + .5) * scale - .5;
+        double total = 0.;
+        int sum = 0, biggest = 0;
+        int last;
+
+        c->weights = weights + i * maxTaps;
+
+        if (quality == RESAMPLE_NEAREST) {
+            c->first = MIN((int)((i + .5) * scale), srcLen - 1);
+            c->n = 1;
+            w[0] = 1.;
+        }
+        else if (area) {
+            /* The part of the source that output pixel i covers */
+            double left = i * scale, right = (i + 1) * scale;
+            c->first = (int)floor(left);
+            last = MIN((int)ceil(right), srcLen) - 1;
+            c->n = last - c->first + 1;
+            for (j = 0; j < c->n; ++j) {
+                double lo = MAX(left, c->first + j);
+                double hi = MIN(right, c->first + j + 1);
+                w[j] = (hi > lo ? hi - lo : 0.);
+            }
+        }
+        else if (quality == RESAMPLE_BEST) {
+            /* Lanczos3, cut off at the edges of the image */
+            double support = LANCZOS_SUPPORT * stretch;
+            c->first = MAX((int)ceil(center - support), 0);
+            last = MIN((int)floor(center + support), srcLen - 1);
+            c->n = MIN(last - c->first + 1, maxTaps);
+            for (j = 0; j < c->n; ++j)
+                w[j] = Lanczos3((c->first + j - center) / stretch);
+        }
+        else {
+            /* Between the two nearest source pixels */
+            double frac;
+            if (center < 0.)
+                center = 0.;
+            c->first = (int)floor(center);
+            frac = center - c->first;
+            if (c->first >= srcLen - 1) {
+                c->first = srcLen - 1;
+                frac = 0.;
+            }
+            c->n = (frac > 0. ? 2 : 1);
+            w[0] = 1. - frac;
+            w[1] = frac;
+        }
+
+        for (j = 0; j < c->n; ++j)
+            total += w[j];
+
+        /* Fixed point, with any rounding error going on the biggest */
+        for (j = 0; j < c->n; ++j) {
+            c->weights[j] = (gint16)floor(w[j] / total * (1 << WEIGHT_BITS)
+                                          + .5);
+            sum += c->weights[j];
+            if (c->weights[j] > c->weights[biggest])
+                biggest = j;
+        }
+        c->weights[biggest] += (1 << WEIGHT_BITS) - sum;
+    }
+    free(w);
+    return contribs;
+}
+
+static void FreeContribs(Contrib* contribs)
+{
+    if (contribs) {
+        free(contribs[0].weights);
+        free(contribs);
+    }
+}
+
+#define ROUND_H (1 << (WEIGHT_BITS - EXTRA_BITS - 1))
+#define SHIFT_H (WEIGHT_BITS - EXTRA_BITS)
+#define ROUND_V (1 << (WEIGHT_BITS + EXTRA_BITS - 1))
+#define SHIFT_V (WEIGHT_BITS + EXTRA_BITS)
+#define ROUND_L (1 << (WEIGHT_BITS - 1))
+#define SHIFT_L WEIGHT_BITS
+
+/* Multiply the color of an RGBA row by its alpha, rounding, so a
+ * transparent pixel's color doesn't bleed into its neighbours.
+ */
+static void PremultiplyRow(const guchar* row, int srcW, guchar* out)
+{
+    int x, ch;
+
+    for (x = 0; x < srcW; ++x, row += 4, out += 4) {
+        for (ch = 0; ch < 3; ++ch) {
+            int t = row[ch] * row[3] + 128;
+            out[ch] = (t + (t >> 8)) >> 8;
+        }
+        out[3] = row[3];
+    }
+}
+
+/* Turn a source row into linear light, one plane per channel,
+ * each plane planeLen long, with any alpha premultiplied.
+ */
+static void ToLinearPlanes(const guchar* row, int srcW, int nch,
+                           guint16* planes, int planeLen)
+{
+    guint16* r = planes;
+    guint16* g = planes + planeLen;
+    guint16* b = planes + 2 * planeLen;
+    guint16* a = planes + 3 * planeLen;
+    int x;
+
+    /* Alpha is premultiplied here, in linear light, where the
+     * filtering happens; doing it in sRGB would darken the edges.
+     */
+    if (nch == 4)
+        for (x = 0; x < srcW; ++x, row += 4) {
+            int alpha = sAlphaToLinear[row[3]];
+            r[x] = (sToLinear[row[0]] * alpha + LINEAR_MAX / 2) / LINEAR_MAX;
+            g[x] = (sToLinear[row[1]] * alpha + LINEAR_MAX / 2) / LINEAR_MAX;
+            b[x] = (sToLinear[row[2]] * alpha + LINEAR_MAX / 2) / LINEAR_MAX;
+            a[x] = alpha;
+        }
+    else
+        for (x = 0; x < srcW; ++x, row += 3) {
+            r[x] = sToLinear[row[0]];
+            g[x] = sToLinear[row[1]];
+            b[x] = sToLinear[row[2]];
+        }
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/* A pair of weights, to go with a pair of 16-bit values in _mm_madd_epi16 */
+static inline __m128i WeightPair(int w0, int w1)
+{
+    return _mm_set1_epi32((int)(((guint32)(guint16)w1 << 16) | (guint16)w0));
+}
+
+/* Filter one source row horizontally into out (width * nch values).
+ * Source pixels are taken two at a time, interleaved channel by
+ * channel so that one _mm_madd_epi16 does both taps for all channels.
+ */
+static void FilterRow(const guchar* row, const guchar* rowEnd, int nch,
+                      Contrib* xc, int width, gint16* out)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(ROUND_H);
+    int x, j;
+
+    for (x = 0; x < width; ++x, out += nch) {
+        const guchar* p = row + xc[x].first * nch;
+        const gint16* w = xc[x].weights;
+        int n = xc[x].n;
+        __m128i acc = zero;
+        __m128i px, second;
+        guint32 one;
+
+        for (j = 0; j + 1 < n; j += 2, p += 2 * nch) {
+            if (p + 8 <= rowEnd)
+                px = _mm_loadl_epi64((const __m128i*)p);
+            else {
+                guchar buf[8] = { 0 };
+                memcpy(buf, p, 2 * nch);
+                px = _mm_loadl_epi64((const __m128i*)buf);
+            }
+            px = _mm_unpacklo_epi8(px, zero);
+            second = (nch == 4) ? _mm_srli_si128(px, 8)
+                                : _mm_srli_si128(px, 6);
+            acc = _mm_add_epi32(acc,
+                                _mm_madd_epi16(_mm_unpacklo_epi16(px, second),
+                                               WeightPair(w[j], w[j+1])));
+        }
+        if (j < n) {
+            one = 0;
+            memcpy(&one, p, nch);
+            px = _mm_unpacklo_epi8(_mm_cvtsi32_si128(one), zero);
+            acc = _mm_add_epi32(acc,
+                                _mm_madd_epi16(_mm_unpacklo_epi16(px, zero),
+                                               WeightPair(w[j], 0)));
+        }
+
+        /* Four values even for three channels: the next pixel,
+         * or the padding, takes the extra one.
+         */
+        acc = _mm_srai_epi32(_mm_add_epi32(acc, round), SHIFT_H);
+        _mm_storel_epi64((__m128i*)out, _mm_packs_epi32(acc, acc));
+    }
+}
+
+/* Filter a row of linear planes horizontally into out (width * nch
+ * values, interleaved again), TAP_ALIGN taps at a time. The four
+ * channels' sums are added across together, like transposing them.
+ */
+static void FilterPlanes(const guint16* planes, int planeLen, int nch,
+                         Contrib* xc, int width, gint16* out)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(ROUND_L);
+    int x, j, ch;
+
+    for (x = 0; x < width; ++x, out += nch) {
+        const gint16* w = xc[x].weights;
+        int n = xc[x].n;
+        __m128i acc[4] = { zero, zero, zero, zero };
+        __m128i lo, hi, sums;
+
+        for (ch = 0; ch < nch; ++ch) {
+            const guint16* p = planes + ch * planeLen + xc[x].first;
+            for (j = 0; j < n; j += TAP_ALIGN)
+                acc[ch] = _mm_add_epi32(acc[ch], _mm_madd_epi16(
+                              _mm_loadu_si128((const __m128i*)(p + j)),
+                              _mm_loadu_si128((const __m128i*)(w + j))));
+        }
+
+        lo = _mm_add_epi32(_mm_unpacklo_epi32(acc[0], acc[1]),
+                           _mm_unpackhi_epi32(acc[0], acc[1]));
+        hi = _mm_add_epi32(_mm_unpacklo_epi32(acc[2], acc[3]),
+                           _mm_unpackhi_epi32(acc[2], acc[3]));
+        sums = _mm_add_epi32(_mm_unpacklo_epi64(lo, hi),
+                             _mm_unpackhi_epi64(lo, hi));
+
+        /* Four values even for three channels, as in FilterRow() */
+        sums = _mm_srai_epi32(_mm_add_epi32(sums, round), SHIFT_L);
+        _mm_storel_epi64((__m128i*)out, _mm_packs_epi32(sums, sums));
+    }
+}
+
+/* Add up the filtered rows for one output row, into acc (len values),
+ * starting from round.
+ */
+static void CombineRows(Contrib* c, gint16** rows, int len, int round,
+                        int* acc)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int i, j;
+
+    for (i = 0; i < len; ++i)
+        acc[i] = round;
+
+    for (j = 0; j < c->n; j += 2) {
+        const gint16* a = rows[j];
+        const gint16* b = (j + 1 < c->n) ? rows[j+1] : 0;
+        __m128i wp = WeightPair(c->weights[j], b ? c->weights[j+1] : 0);
+
+        for (i = 0; i + 8 <= len; i += 8) {
+            __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+            __m128i vb = b ? _mm_loadu_si128((const __m128i*)(b + i)) : zero;
+            __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(va, vb), wp);
+            __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi16(va, vb), wp);
+            __m128i* dst = (__m128i*)(acc + i);
+            _mm_storeu_si128(dst, _mm_add_epi32(_mm_loadu_si128(dst), lo));
+            _mm_storeu_si128(dst + 1,
+                             _mm_add_epi32(_mm_loadu_si128(dst + 1), hi));
+        }
+        for (; i < len; ++i)
+            acc[i] += c->weights[j] * a[i]
+                + (b ? c->weights[j+1] * b[i] : 0);
+    }
+}
+
+#else /* HAVE_X86_KERNELS */
+
+static void FilterRow(const guchar* row, const guchar* rowEnd, int nch,
+                      Contrib* xc, int width, gint16* out)
+{
+    int x, j, ch;
+
+    for (x = 0; x < width; ++x, out += nch) {
+        const guchar* p = row + xc[x].first * nch;
+        const gint16* w = xc[x].weights;
+        int acc[4] = { 0, 0, 0, 0 };
+
+        for (j = 0; j < xc[x].n; ++j, p += nch)
+            for (ch = 0; ch < nch; ++ch)
+                acc[ch] += w[j] * p[ch];
+        for (ch = 0; ch < nch; ++ch)
+            out[ch] = (acc[ch] + ROUND_H) >> SHIFT_H;
+    }
+}
+
+static void FilterPlanes(const guint16* planes, int planeLen, int nch,
+                         Contrib* xc, int width, gint16* out)
+{
+    int x, j, ch;
+
+    for (x = 0; x < width; ++x, out += nch) {
+        const gint16* w = xc[x].weights;
+
+        for (ch = 0; ch < nch; ++ch) {
+            const guint16* p = planes + ch * planeLen + xc[x].first;
+            int acc = 0;
+
+            for (j = 0; j < xc[x].n; ++j)
+                acc += w[j] * p[j];
+            out[ch] = (acc + ROUND_L) >> SHIFT_L;
+        }
+    }
+}
+
+static void CombineRows(Contrib* c, gint16** rows, int len, int round,
+                        int* acc)
+{
+    int i, j;
+
+    for (i = 0; i < len; ++i)
+        acc[i] = round;
+    for (j = 0; j < c->n; ++j) {
+        const gint16* row = rows[j];
+        int w = c->weights[j];
+        for (i = 0; i < len; ++i)
+            acc[i] += w * row[i];
+    }
+}
+
+#endif /* HAVE_X86_KERNELS */
+
+/* Make output rows y0 to y1 of a strip */
+static void ResampleStrip(Strip* s)
+{
+    int srcW = gdk_pixbuf_get_width(s->src);
+    int srcStride = gdk_pixbuf_get_rowstride(s->src);
+    int nch = gdk_pixbuf_get_n_channels(s->src);
+    const guchar* srcPixels = gdk_pixbuf_get_pixels(s->src);
+    int width = s->width, height = s->height;
+    int len = width * nch;
+    int slotLen = len + ROW_PAD;
+    int planeLen = srcW + TAP_ALIGN;
+    int round = s->linear ? ROUND_L : ROUND_V;
+    int shift = s->linear ? SHIFT_L : SHIFT_V;
+    int premul = (nch == 4);
+    int top = s->linear ? LINEAR_MAX : 255;
+    gint16* ring;
+    gint16** rows;
+    int* ringRow;       /* which source row is in each ring slot */
+    int* acc;
+    guint16* planes = 0;
+    guchar* pre = 0;    /* a premultiplied source row */
+    int x, y, j, ch;
+
+    ring = malloc((size_t)s->ringSize * slotLen * sizeof (gint16));
+    rows = malloc(s->ringSize * sizeof (gint16*));
+    ringRow = malloc(s->ringSize * sizeof (int));
+    acc = malloc((size_t)len * sizeof (int));
+    /* Zeroed, so the padding the kernel reads past the end is */
+    if (s->linear)
+        planes = calloc((size_t)nch * planeLen, sizeof (guint16));
+    else if (premul)
+        pre = malloc((size_t)srcW * 4);
+    if (!ring || !rows || !ringRow || !acc || (s->linear && !planes)
+        || (premul && !s->linear && !pre)) {
+        free(ring);
+        free(rows);
+        free(ringRow);
+        free(acc);
+        free(planes);
+        free(pre);
+        return;
+    }
+    for (j = 0; j < s->ringSize; ++j)
+        ringRow[j] = -1;
+
+    for (y = s->y0; y < s->y1; ++y) {
+        Contrib* c = s->yc + y;
+        guchar* out;
+        int step;
+
+        /* Filter any source rows we haven't yet. Rows only move
+         * forward, so a ring of ringSize always has the ones needed.
+         */
+        for (j = 0; j < c->n; ++j) {
+            int sy = c->first + j;
+            int slot = sy % s->ringSize;
+            const guchar* row = srcPixels + sy * srcStride;
+            rows[j] = ring + (size_t)slot * slotLen;
+            if (ringRow[slot] != sy) {
+                if (s->linear) {
+                    ToLinearPlanes(row, srcW, nch, planes, planeLen);
+                    FilterPlanes(planes, planeLen, nch, s->xc, width,
+                                 rows[j]);
+                }
+                else {
+                    if (premul) {
+                        PremultiplyRow(row, srcW, pre);
+                        row = pre;
+                    }
+                    FilterRow(row, row + srcW * nch, nch, s->xc, width,
+                              rows[j]);
+                }
+                ringRow[slot] = sy;
+            }
+        }
+        /* Premultiplied sums are rounded as they're divided out below */
+        CombineRows(c, rows, len, premul ? 0 : round, acc);
+
+        /* Where output row y goes, and which way along it x runs */
+        switch (s->degrees) {
+          case 90:
+            out = s->dstPixels + (height - 1 - y) * nch;
+            step = s->dstStride;
+            break;
+          case 180:
+            out = s->dstPixels + (height - 1 - y) * s->dstStride
+                + (width - 1) * nch;
+            step = -nch;
+            break;
+          case 270:
+            out = s->dstPixels + (width - 1) * s->dstStride + y * nch;
+            step = -s->dstStride;
+            break;
+          default:
+            out = s->dstPixels + y * s->dstStride;
+            step = nch;
+            break;
+        }
+
+        if (premul)
+            for (x = 0; x < width; ++x, out += step) {
+                const int* p = acc + x * 4;
+                int v = (p[3] + round) >> shift;
+
+                /* Divide the alpha back out; a clear pixel has no color */
+                for (ch = 0; ch < 3; ++ch) {
+                    gint64 c = (p[3] > 0)
+                        ? ((gint64)p[ch] * top + p[3] / 2) / p[3] : 0;
+                    c = CLAMP(c, 0, top);
+                    out[ch] = s->linear ? sFromLinear[c] : c;
+                }
+                v = CLAMP(v, 0, top);
+                out[3] = s->linear ? sAlphaFromLinear[v] : v;
+            }
+        else if (s->linear)
+            for (x = 0; x < width; ++x, out += step)
+                for (ch = 0; ch < nch; ++ch) {
+                    int v = acc[x * nch + ch] >> shift;
+                    v = CLAMP(v, 0, LINEAR_MAX);
+                    out[ch] = sFromLinear[v];
+                }
+        else
+            for (x = 0; x < width; ++x, out += step)
+                for (ch = 0; ch < nch; ++ch) {
+                    int v = acc[x * nch + ch] >> shift;
+                    out[ch] = CLAMP(v, 0, 255);
+                }
+    }
+
+    free(ring);
+    free(rows);
+    free(ringRow);
+    free(acc);
+    free(planes);
+    free(pre);
+    s->ok = 1;
+}
+
+/* Do strips of set until there are none left to take */
+static void TakeStrips(StripSet* set)
+{
+    int i;
+
+    while ((i = g_atomic_int_add(&set->next, 1)) < set->nstrips) {
+        ResampleStrip(set->strips + i);
+        g_mutex_lock(&set->lock);
+        if (--set->left == 0)
+            g_cond_signal(&set->finished);
+        g_mutex_unlock(&set->lock);
+    }
+}
+
+static void ReleaseStrips(StripSet* set)
+{
+    if (g_atomic_int_dec_and_test(&set->refs)) {
+        g_mutex_clear(&set->lock);
+        g_cond_clear(&set->finished);
+        free(set);
+    }
+}
+
+/* Runs in a worker thread. By the time it starts, the caller
+ * may have done all the strips itself.
+ */
+static void HelpWithStrips(gpointer data, GCancellable* cancel)
+{
+    StripSet* set = (StripSet*)data;
+
+    TakeStrips(set);
+    ReleaseStrips(set);
+}
+
+/* Scale src to width x height and rotate it by degrees (0, 90, 180
+ * or 270), with one of the RESAMPLE_ filters, plus RESAMPLE_LINEAR to
+ * do it in linear light. width and height are the size before rotating.
+ * Returns a new pixbuf, or 0 if out of memory.
+ */
+GdkPixbuf* ScaleRotatePixbuf(GdkPixbuf* src, int width, int height,
+                             int degrees, int quality)
+{
+    int srcW = gdk_pixbuf_get_width(src);
+    int srcH = gdk_pixbuf_get_height(src);
+    int nch = gdk_pixbuf_get_n_channels(src);
+    int quarter = (degrees == 90 || degrees == 270);
+    double pixels = (double)srcW * srcH + (double)width * height;
+    StripSet* set;
+    GdkPixbuf* dst;
+    Contrib* xc;
+    Contrib* yc;
+    int linear = (quality & RESAMPLE_LINEAR) != 0;
+    int nstrips = 1, ringSize = 0;
+    int i, y, ok = 1;
+
+    /* Picking the nearest pixel looks the same either way */
+    quality &= ~RESAMPLE_LINEAR;
+    if (quality == RESAMPLE_NEAREST)
+        linear = 0;
+    if (linear)
+        MakeLinearTables();
+
+    if (width < 1 || height < 1 || nch < 3 || nch > 4
+        || gdk_pixbuf_get_bits_per_sample(src) != 8)
+        return 0;
+
+    xc = MakeContribs(srcW, width, quality);
+    yc = MakeContribs(srcH, height, quality);
+    set = calloc(1, sizeof (StripSet));
+    dst = (xc && yc && set)
+        ? gdk_pixbuf_new(GDK_COLORSPACE_RGB, gdk_pixbuf_get_has_alpha(src),
+                         8, quarter ? height : width,
+                         quarter ? width : height)
+        : 0;
+    if (!dst) {
+        FreeContribs(xc);
+        FreeContribs(yc);
+        free(set);
+        return 0;
+    }
+    for (y = 0; y < height; ++y)
+        ringSize = MAX(ringSize, yc[y].n);
+
+    if (pixels >= MIN_THREADED_PIXELS)
+        nstrips = CLAMP(MIN(SpareWorkers() + 1, height / MIN_STRIP_ROWS),
+                        1, MAX_STRIPS);
+    set->nstrips = nstrips;
+    set->left = nstrips;
+    set->refs = 1;
+    g_mutex_init(&set->lock);
+    g_cond_init(&set->finished);
+
+    for (i = 0; i < nstrips; ++i) {
+        Strip* s = set->strips + i;
+        s->src = src;
+        s->dstPixels = gdk_pixbuf_get_pixels(dst);
+        s->dstStride = gdk_pixbuf_get_rowstride(dst);
+        s->width = width;
+        s->height = height;
+        s->degrees = degrees;
+        s->xc = xc;
+        s->yc = yc;
+        s->ringSize = ringSize;
+        s->linear = linear;
+        s->y0 = height * i / nstrips;
+        s->y1 = height * (i + 1) / nstrips;
+        s->ok = 0;
+    }
+
+    /* Ask the spare workers for help, and get on with it meanwhile.
+     * This is always what somebody's waiting for, so it goes first.
+     */
+    for (i = 1; i < nstrips; ++i) {
+        g_atomic_int_inc(&set->refs);
+        if (!QueueWork(WORK_CURRENT, HelpWithStrips, 0, set))
+            g_atomic_int_add(&set->refs, -1);
+    }
+    TakeStrips(set);
+
+    /* Then wait for any strips the workers took */
+    g_mutex_lock(&set->lock);
+    while (set->left > 0)
+        g_cond_wait(&set->finished, &set->lock);
+    g_mutex_unlock(&set->lock);
+
+    for (i = 0; i < nstrips; ++i)
+        ok = ok && set->strips[i].ok;
+    ReleaseStrips(set);
+
+    FreeContribs(xc);
+    FreeContribs(yc);
+    if (!ok) {
+        g_object_unref(dst);
+        return 0;
+    }
+    return dst;
+}
@@ -0,0 +1,514 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * rotate.c: rotate pixbufs by multiples of 90 degrees, and mirror them,
+ * for pho, an image viewer.
+ *
+ * Copyright 2016 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+/* Rotating by 90 or 270 degrees reads the source a row at a time but
+ * writes the destination a column at a time, so the obvious
+ * pixel-by-pixel loop touches a different cache line (and, on a big
+ * image, a different page) for every pixel it writes. Instead the
+ * image is done in TILE x TILE pixel squares, small enough that the
+ * rows of both the source and the destination tile stay in cache.
+ *
+ * Within a tile, on x86, small blocks of pixels are transposed in
+ * vector registers: 4x4 with SSE2 for 4-channel pixbufs (SSE2 is
+ * always there on x86-64), two 4x4 blocks at once with AVX2 where the
+ * CPU has it, and 4x4 with SSSE3 for 3-channel ones, whose 3-byte
+ * pixels have to be spread out to 4 bytes and packed back with byte
+ * shuffles.
+ * Which ones the CPU has is checked once, at run time. Anything left
+ * over at the edges goes a pixel at a time.
+ *
+ * Mirroring, for the EXIF orientations that have it, is done in place:
+ * each row is reversed by swapping blocks of 4 pixels from its two
+ * ends, with the same shuffles.
+ *
+ * It's all just copying bytes, so every path gives exactly the same
+ * result.
+ *
+ * The one piece of state is which kernels the CPU can run, found the
+ * first time through by CheckCpu(), so the workers rotate with these
+ * too.
+ */
+
+#include "pho.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__SSE2__) \
+    && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+/* Pixels on a side: a 32 x 32 tile of 4-byte pixels is 4k,
+ * so source and destination together fit in any L1 cache.
+ */
+#define TILE 32
+
+/* Transpose one block of pixels at (x, y) in a w x h source,
+ * rotating by 90 (or 270) degrees into dst.
+ */
+typedef void (*BlockFunc)(const guchar* src, int srcStride,
+                          guchar* dst, int dstStride,
+                          int x, int y, int w, int h);
+
+typedef struct {
+    BlockFunc rot90, rot270;
+    int width, height;      /* of the block, in source pixels */
+} BlockKernel;
+
+static inline void CopyPixel(guchar* dst, const guchar* src, int nch)
+{
+    if (nch == 4)
+        memcpy(dst, src, 4);
+    else if (nch == 3)
+        memcpy(dst, src, 3);
+    else
+        memcpy(dst, src, nch);
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/* Transpose a 4x4 block of 32-bit pixels in place */
+#define TRANSPOSE4(r0, r1, r2, r3) {                        \
+        __m128i t0 = _mm_unpacklo_epi32(r0, r1);            \
+        __m128i t1 = _mm_unpacklo_epi32(r2, r3);            \
+        __m128i t2 = _mm_unpackhi_epi32(r0, r1);            \
+        __m128i t3 = _mm_unpackhi_epi32(r2, r3);            \
+        r0 = _mm_unpacklo_epi64(t0, t1);                    \
+        r1 = _mm_unpackhi_epi64(t0, t1);                    \
+        r2 = _mm_unpacklo_epi64(t2, t3);                    \
+        r3 = _mm_unpackhi_epi64(t2, t3);                    \
+    }
+
+/* Source column x+k becomes destination row x+k (90 degrees) or
+ * w-1-x-k (270); for 90 degrees it also runs backwards.
+ */
+static void Block4x4Rgba(const guchar* src, int srcStride,
+                         guchar* dst, int dstStride,
+                         int x, int y, int w, int h, int degrees)
+{
+    const guchar* s = src + y * srcStride + x * 4;
+    __m128i r[4];
+    int k;
+
+    r[0] = _mm_loadu_si128((const __m128i*)s);
+    r[1] = _mm_loadu_si128((const __m128i*)(s + srcStride));
+    r[2] = _mm_loadu_si128((const __m128i*)(s + 2 * srcStride));
+    r[3] = _mm_loadu_si128((const __m128i*)(s + 3 * srcStride));
+    TRANSPOSE4(r[0], r[1], r[2], r[3]);
+
+    for (k = 0; k < 4; ++k) {
+        if (degrees == 90)
+            _mm_storeu_si128((__m128i*)(dst + (x + k) * dstStride
+                                        + (h - y - 4) * 4),
+                             _mm_shuffle_epi32(r[k], 0x1b));
+        else
+            _mm_storeu_si128((__m128i*)(dst + (w - 1 - x - k) * dstStride
+                                        + y * 4),
+                             r[k]);
+    }
+}
+
+static void Rot90Rgba4(const guchar* src, int srcStride,
+                       guchar* dst, int dstStride, int x, int y, int w, int h)
+{
+    Block4x4Rgba(src, srcStride, dst, dstStride, x, y, w, h, 90);
+}
+
+static void Rot270Rgba4(const guchar* src, int srcStride,
+                        guchar* dst, int dstStride, int x, int y, int w, int h)
+{
+    Block4x4Rgba(src, srcStride, dst, dstStride, x, y, w, h, 270);
+}
+
+/* The same with 3-byte pixels: spread each row of 4 out to 16 bytes,
+ * transpose, and pack the 4 columns back into 12 bytes each.
+ * The rows are loaded and stored 12 bytes at a time, so nothing
+ * past the block is read or written.
+ */
+__attribute__((target("ssse3")))
+static void Block4x4Rgb(const guchar* src, int srcStride,
+                        guchar* dst, int dstStride,
+                        int x, int y, int w, int h, int degrees)
+{
+    const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+                                         6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9,
+                                       10, 12, 13, 14, -1, -1, -1, -1);
+    const __m128i packRev = _mm_setr_epi8(12, 13, 14, 8, 9, 10, 4, 5,
+                                          6, 0, 1, 2, -1, -1, -1, -1);
+    const guchar* s = src + y * srcStride + x * 3;
+    __m128i r[4];
+    int k;
+
+    for (k = 0; k < 4; ++k) {
+        const guchar* p = s + k * srcStride;
+        int tail;
+        memcpy(&tail, p + 8, 4);
+        r[k] = _mm_shuffle_epi8(
+                   _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)p),
+                                      _mm_cvtsi32_si128(tail)),
+                   spread);
+    }
+    TRANSPOSE4(r[0], r[1], r[2], r[3]);
+
+    for (k = 0; k < 4; ++k) {
+        guchar* d;
+        __m128i v;
+        int tail;
+
+        if (degrees == 90) {
+            d = dst + (x + k) * dstStride + (h - y - 4) * 3;
+            v = _mm_shuffle_epi8(r[k], packRev);
+        } else {
+            d = dst + (w - 1 - x - k) * dstStride + y * 3;
+            v = _mm_shuffle_epi8(r[k], pack);
+        }
+        _mm_storel_epi64((__m128i*)d, v);
+        tail = _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+        memcpy(d + 8, &tail, 4);
+    }
+}
+
+__attribute__((target("ssse3")))
+static void Rot90Rgb4(const guchar* src, int srcStride,
+                      guchar* dst, int dstStride, int x, int y, int w, int h)
+{
+    Block4x4Rgb(src, srcStride, dst, dstStride, x, y, w, h, 90);
+}
+
+__attribute__((target("ssse3")))
+static void Rot270Rgb4(const guchar* src, int srcStride,
+                       guchar* dst, int dstStride, int x, int y, int w, int h)
+{
+    Block4x4Rgb(src, srcStride, dst, dstStride, x, y, w, h, 270);
+}
+
+/* Two 4x4 blocks side by side, with AVX2: the unpack instructions
+ * work on each 128-bit half separately, so one set of them
+ * transposes both blocks at once.
+ */
+__attribute__((target("avx2")))
+static void Block4x8Rgba(const guchar* src, int srcStride,
+                         guchar* dst, int dstStride,
+                         int x, int y, int w, int h, int degrees)
+{
+    const guchar* s = src + y * srcStride + x * 4;
+    __m256i r0, r1, r2, r3, t0, t1, t2, t3;
+    __m256i c[4];
+    int k;
+
+    r0 = _mm256_loadu_si256((const __m256i*)s);
+    r1 = _mm256_loadu_si256((const __m256i*)(s + srcStride));
+    r2 = _mm256_loadu_si256((const __m256i*)(s + 2 * srcStride));
+    r3 = _mm256_loadu_si256((const __m256i*)(s + 3 * srcStride));
+    t0 = _mm256_unpacklo_epi32(r0, r1);
+    t1 = _mm256_unpacklo_epi32(r2, r3);
+    t2 = _mm256_unpackhi_epi32(r0, r1);
+    t3 = _mm256_unpackhi_epi32(r2, r3);
+    c[0] = _mm256_unpacklo_epi64(t0, t1);
+    c[1] = _mm256_unpackhi_epi64(t0, t1);
+    c[2] = _mm256_unpacklo_epi64(t2, t3);
+    c[3] = _mm256_unpackhi_epi64(t2, t3);
+    if (degrees == 90)
+        for (k = 0; k < 4; ++k)
+            c[k] = _mm256_shuffle_epi32(c[k], 0x1b);
+
+    /* Column x+k is in the low half of c[k], x+4+k in the high half */
+    for (k = 0; k < 4; ++k) {
+        guchar* d0;
+        guchar* d1;
+        if (degrees == 90) {
+            d0 = dst + (x + k) * dstStride + (h - y - 4) * 4;
+            d1 = d0 + 4 * dstStride;
+        } else {
+            d0 = dst + (w - 1 - x - k) * dstStride + y * 4;
+            d1 = d0 - 4 * dstStride;
+        }
+        _mm_storeu_si128((__m128i*)d0, _mm256_castsi256_si128(c[k]));
+        _mm_storeu_si128((__m128i*)d1, _mm256_extracti128_si256(c[k], 1));
+    }
+}
+
+__attribute__((target("avx2")))
+static void Rot90Rgba4x8(const guchar* src, int srcStride,
+                       guchar* dst, int dstStride, int x, int y, int w, int h)
+{
+    Block4x8Rgba(src, srcStride, dst, dstStride, x, y, w, h, 90);
+}
+
+__attribute__((target("avx2")))
+static void Rot270Rgba4x8(const guchar* src, int srcStride,
+                        guchar* dst, int dstStride, int x, int y, int w, int h)
+{
+    Block4x8Rgba(src, srcStride, dst, dstStride, x, y, w, h, 270);
+}
+
+#endif /* HAVE_X86_KERNELS */
+
+#ifdef HAVE_X86_KERNELS
+static int sAvx2 = 0, sSsse3 = 0;
+
+/* See which of the kernels this CPU can run, the first time through */
+static void CheckCpu(void)
+{
+    static gsize sChecked = 0;
+
+    if (g_once_init_enter(&sChecked)) {
+        __builtin_cpu_init();
+        sAvx2 = __builtin_cpu_supports("avx2");
+        sSsse3 = __builtin_cpu_supports("ssse3");
+        g_once_init_leave(&sChecked, 1);
+    }
+}
+#endif
+
+/* The best block kernel this CPU has for nch-channel pixels,
+ * or 0 to go a pixel at a time.
+ */
+static const BlockKernel* ChooseKernel(int nch)
+{
+#ifdef HAVE_X86_KERNELS
+    static const BlockKernel rgba4 = { Rot90Rgba4, Rot270Rgba4, 4, 4 };
+    static const BlockKernel rgba8 = { Rot90Rgba4x8, Rot270Rgba4x8, 8, 4 };
+    static const BlockKernel rgb4 = { Rot90Rgb4, Rot270Rgb4, 4, 4 };
+
+    CheckCpu();
+    if (nch == 4)
+        return sAvx2 ? &rgba8 : &rgba4;
+    if (nch == 3 && sSsse3)
+        return &rgb4;
+#endif
+    return 0;
+}
+
+/* Rotate a w x h, nch-channel image by 90 or 270 degrees,
+ * a tile at a time.
+ */
+static void RotateQuarter(const guchar* src, int srcStride,
+                          guchar* dst, int dstStride,
+                          int w, int h, int nch, int degrees)
+{
+    const BlockKernel* kernel = ChooseKernel(nch);
+    BlockFunc block = kernel ? (degrees == 90 ? kernel->rot90
+                                : kernel->rot270) : 0;
+    int bw = kernel ? kernel->width : 1;
+    int bh = kernel ? kernel->height : 1;
+    int tx, ty, bx, by, x, y;
+
+    for (ty = 0; ty < h; ty += TILE) {
+        int tyEnd = MIN(ty + TILE, h);
+        for (tx = 0; tx < w; tx += TILE) {
+            int txEnd = MIN(tx + TILE, w);
+
+            for (by = ty; by < tyEnd; by += bh) {
+                for (bx = tx; bx < txEnd; bx += bw) {
+                    int yEnd, xEnd;
+
+                    if (block && by + bh <= tyEnd && bx + bw <= txEnd) {
+                        block(src, srcStride, dst, dstStride, bx, by, w, h);
+                        continue;
+                    }
+
+                    /* A partial block at the edge */
+                    yEnd = MIN(by + bh, tyEnd);
+                    xEnd = MIN(bx + bw, txEnd);
+                    for (y = by; y < yEnd; ++y)
+                        for (x = bx; x < xEnd; ++x) {
+                            guchar* d = (degrees == 90)
+                                ? dst + x * dstStride + (h - 1 - y) * nch
+                                : dst + (w - 1 - x) * dstStride + y * nch;
+                            CopyPixel(d, src + y * srcStride + x * nch, nch);
+                        }
+                }
+            }
+        }
+    }
+}
+
+/* Rotate by 180 degrees: each row is reversed into the mirror row,
+ * so both sides are read and written in order anyway.
+ */
+static void RotateHalf(const guchar* src, int srcStride,
+                       guchar* dst, int dstStride, int w, int h, int nch)
+{
+    int x, y;
+
+    for (y = 0; y < h; ++y) {
+        const guchar* s = src + y * srcStride;
+        guchar* d = dst + (h - 1 - y) * dstStride + (w - 1) * nch;
+
+        x = 0;
+#ifdef HAVE_X86_KERNELS
+        if (nch == 4)
+            for ( ; x + 4 <= w; x += 4) {
+                __m128i v = _mm_loadu_si128((const __m128i*)(s + x * 4));
+                _mm_storeu_si128((__m128i*)(d - (x + 3) * 4),
+                                 _mm_shuffle_epi32(v, 0x1b));
+            }
+#endif
+        for ( ; x < w; ++x)
+            CopyPixel(d - x * nch, s + x * nch, nch);
+    }
+}
+
+/* Make a rotated copy of pix. degrees must be 90, 180 or 270.
+ * Returns a new pixbuf, or 0 on failure.
+ */
+GdkPixbuf* RotatePixbuf(GdkPixbuf* pix, int degrees)
+{
+    guchar *oldpixels, *newpixels;
+    int oldWidth, oldHeight, newWidth, newHeight;
+    int oldrowstride, newrowstride, nchannels, bitsper, alpha;
+    GdkPixbuf* newImage;
+
+    if (degrees != 90 && degrees != 180 && degrees != 270) {
+        printf("Illegal rotation value!\n");
+        return 0;
+    }
+
+    oldWidth = gdk_pixbuf_get_width(pix);
+    oldHeight = gdk_pixbuf_get_height(pix);
+
+    /* Swap X and Y if appropriate */
+    if (degrees == 90 || degrees == 270)
+    {
+        newWidth = oldHeight;
+        newHeight = oldWidth;
+    }
+    else
+    {
+        newWidth = oldWidth;
+        newHeight = oldHeight;
+    }
+
+    oldrowstride = gdk_pixbuf_get_rowstride(pix);
+    bitsper = gdk_pixbuf_get_bits_per_sample(pix);
+    nchannels = gdk_pixbuf_get_n_channels(pix);
+    alpha = gdk_pixbuf_get_has_alpha(pix);
+
+    oldpixels = gdk_pixbuf_get_pixels(pix);
+
+    newImage = gdk_pixbuf_new(GDK_COLORSPACE_RGB, alpha, bitsper,
+                              newWidth, newHeight);
+    if (!newImage) return 0;
+    newpixels = gdk_pixbuf_get_pixels(newImage);
+    newrowstride = gdk_pixbuf_get_rowstride(newImage);
+
+    if (degrees == 180)
+        RotateHalf(oldpixels, oldrowstride, newpixels, newrowstride,
+                   oldWidth, oldHeight, nchannels);
+    else
+        RotateQuarter(oldpixels, oldrowstride, newpixels, newrowstride,
+                      oldWidth, oldHeight, nchannels, degrees);
+
+    return newImage;
+}
+
+static inline void SwapPixel(guchar* a, guchar* b, int nch)
+{
+    guchar t[8];
+
+    memcpy(t, a, nch);
+    memcpy(a, b, nch);
+    memcpy(b, t, nch);
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/* Reverse the w 4-byte pixels of row in place, 4 from each end at a
+ * time, and return how many pixels at each end have been done.
+ */
+static int MirrorRowRgba(guchar* row, int w)
+{
+    int x;
+
+    for (x = 0; 2 * x + 8 <= w; x += 4) {
+        guchar* l = row + x * 4;
+        guchar* r = row + (w - 4 - x) * 4;
+        __m128i a = _mm_loadu_si128((const __m128i*)l);
+        __m128i b = _mm_loadu_si128((const __m128i*)r);
+        _mm_storeu_si128((__m128i*)l, _mm_shuffle_epi32(b, 0x1b));
+        _mm_storeu_si128((__m128i*)r, _mm_shuffle_epi32(a, 0x1b));
+    }
+    return x;
+}
+
+/* 4 3-byte pixels at p, reversed. Only 12 bytes are read. */
+__attribute__((target("ssse3")))
+static inline __m128i LoadRevRgb4(const guchar* p)
+{
+    const __m128i rev = _mm_setr_epi8(9, 10, 11, 6, 7, 8, 3, 4,
+                                      5, 0, 1, 2, -1, -1, -1, -1);
+    int tail;
+
+    memcpy(&tail, p + 8, 4);
+    return _mm_shuffle_epi8(
+               _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)p),
+                                  _mm_cvtsi32_si128(tail)),
+               rev);
+}
+
+__attribute__((target("ssse3")))
+static inline void StoreRgb4(guchar* p, __m128i v)
+{
+    int tail = _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+
+    _mm_storel_epi64((__m128i*)p, v);
+    memcpy(p + 8, &tail, 4);
+}
+
+/* The same for 3-byte pixels, with SSSE3 */
+__attribute__((target("ssse3")))
+static int MirrorRowRgb(guchar* row, int w)
+{
+    int x;
+
+    for (x = 0; 2 * x + 8 <= w; x += 4) {
+        guchar* l = row + x * 3;
+        guchar* r = row + (w - 4 - x) * 3;
+        __m128i a = LoadRevRgb4(l);
+        __m128i b = LoadRevRgb4(r);
+        StoreRgb4(l, b);
+        StoreRgb4(r, a);
+    }
+    return x;
+}
+#endif
+
+/* Mirror pix left to right, in place. Unlike rotating, that needs
+ * no new pixbuf: each row just gets reversed.
+ */
+void MirrorPixbuf(GdkPixbuf* pix)
+{
+    guchar* pixels = gdk_pixbuf_get_pixels(pix);
+    int w = gdk_pixbuf_get_width(pix);
+    int h = gdk_pixbuf_get_height(pix);
+    int rowstride = gdk_pixbuf_get_rowstride(pix);
+    int nch = gdk_pixbuf_get_n_channels(pix);
+    int x, y;
+
+#ifdef HAVE_X86_KERNELS
+    CheckCpu();
+#endif
+    for (y = 0; y < h; ++y) {
+        guchar* row = pixels + y * rowstride;
+
+        x = 0;
+#ifdef HAVE_X86_KERNELS
+        if (nch == 4)
+            x = MirrorRowRgba(row, w);
+        else if (nch == 3 && sSsse3)
+            x = MirrorRowRgb(row, w);
+#endif
+        for ( ; x < w - 1 - x; ++x)
+            SwapPixel(row + x * nch, row + (w - 1 - x) * nch, nch);
+    }
+}
@@ -0,0 +1,299 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * scan.c: find the images in directories, for pho, an image viewer.
+ *
+ * Copyright 2016 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+/* Directories given on the command line (and with -R, everything
+ * under them) are read by the worker threads, one directory per job.
+ * Rather than trusting filename extensions, each file's first few
+ * bytes are checked against the signatures of the formats gdk-pixbuf
+ * has loaders for, the same way gdk-pixbuf picks a loader, so
+ * non-images never make it into the list in the first place.
+ *
+ * Each directory's images are handed to the main loop, sorted,
+ * as soon as it's been read, and go on the end of the list with
+ * AppendItem(). The first image can be showing long before a big
+ * tree has been scanned.
+ */
+
+/* for the loaders' signatures in GdkPixbufFormat */
+#define GDK_PIXBUF_ENABLE_BACKEND 1
+#include "pho.h"
+#include <gdk-pixbuf/gdk-pixbuf-io.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* Enough of the start of a file to tell what it is:
+ * as much as gdk-pixbuf itself looks at.
+ */
+#define SNIFF_BYTES 4096
+
+/* The formats gdk-pixbuf has loaders for. The formats themselves
+ * belong to gdk-pixbuf and last as long as the program.
+ */
+static GdkPixbufFormat** sFormats = 0;
+static int sNumFormats = 0;
+
+/* Descend into subdirectories */
+int gScanRecursive = 0;
+
+typedef struct {
+    char* dirname;
+    GPtrArray* files;       /* images found, sorted */
+} ScanResult;
+
+static GSList* sDirsToScan = 0;    /* until StartScan() */
+
+/* Directories queued but not yet added to the list.
+ * Threads add to it for subdirectories, before they report
+ * their own directory finished, so it can't reach 0 too soon.
+ */
+static gint sOutstanding = 0;
+
+/* Find the formats gdk-pixbuf has loaders for, including any
+ * third-party ones. Call this from the main thread before anything
+ * uses SniffImageData().
+ */
+void FindImageLoaders()
+{
+    static int sFound = 0;
+    GSList* formats;
+    GSList* f;
+
+    if (sFound)
+        return;
+    sFound = 1;
+
+    formats = gdk_pixbuf_get_formats();
+    sFormats = calloc(g_slist_length(formats), sizeof (GdkPixbufFormat*));
+    for (f = formats; f && sFormats; f = f->next)
+        if (!gdk_pixbuf_format_is_disabled((GdkPixbufFormat*)f->data))
+            sFormats[sNumFormats++] = (GdkPixbufFormat*)f->data;
+    g_slist_free(formats);
+}
+
+/* How well data, len bytes long, matches format's signature, the way
+ * gdk-pixbuf decides which loader to use: the relevance of the first
+ * pattern that matches, or 0. A mask starting with '*' means the
+ * pattern can be anywhere; otherwise, for each byte, ' ' means it
+ * must match, '!' that it mustn't, 'z' that it's zero, 'n' that
+ * it isn't, and 'x' that it doesn't matter.
+ */
+static int MatchSignature(GdkPixbufFormat* format,
+                          const unsigned char* data, gsize len)
+{
+    GdkPixbufModulePattern* pattern;
+
+    for (pattern = format->signature; pattern && pattern->prefix; ++pattern) {
+        const unsigned char* prefix = (const unsigned char*)pattern->prefix;
+        const char* mask = pattern->mask;
+        int anchored = 1;
+        gsize i, j;
+
+        if (mask && mask[0] == '*') {
+            ++prefix;
+            ++mask;
+            anchored = 0;
+        }
+        for (i = 0; i < len; ++i) {
+            for (j = 0; i + j < len && prefix[j]; ++j) {
+                char m = (mask ? mask[j] : ' ');
+                if ((m == ' ' && data[i + j] != prefix[j])
+                    || (m == '!' && data[i + j] == prefix[j])
+                    || (m == 'z' && data[i + j] != 0)
+                    || (m == 'n' && data[i + j] == 0))
+                    break;
+            }
+            if (!prefix[j])
+                return pattern->relevance;
+            if (anchored)
+                break;
+        }
+    }
+    return 0;
+}
+
+/* Does data, the first len bytes of a file, look like an image
+ * we can load? Safe to call from any thread once FindImageLoaders()
+ * has run.
+ */
+int SniffImageData(const unsigned char* data, gsize len)
+{
+    int i;
+
+    if (len > SNIFF_BYTES)
+        len = SNIFF_BYTES;
+    for (i = 0; i < sNumFormats; ++i)
+        if (MatchSignature(sFormats[i], data, len) > 0)
+            return 1;
+    return 0;
+}
+
+/* Does filename start like an image we can load? */
+int SniffImageFile(char* filename)
+{
+    unsigned char buf[SNIFF_BYTES];
+    int fd, len;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    len = read(fd, buf, sizeof buf);
+    close(fd);
+
+    return (len > 0 && SniffImageData(buf, len));
+}
+
+static gint CompareNames(gconstpointer a, gconstpointer b)
+{
+    return strcmp(*(char**)a, *(char**)b);
+}
+
+static void AddScanned(gpointer data);    /* forward */
+static void ScanOneDirectory(gpointer data, GCancellable* cancel);
+
+/* One queued directory is done with, one way or another. If it was
+ * the last, and nothing turned up, there's nothing to show.
+ * Only the main thread can let go of the last one: a directory
+ * queued by a worker belongs to one that's still outstanding.
+ */
+static void DirectoryDone()
+{
+    if (g_atomic_int_dec_and_test(&sOutstanding)) {
+        if (gDebug) printf("Finished scanning directories\n");
+        if (!gFirstImage) {
+            fprintf(stderr, "No images found\n");
+            exit(1);
+        }
+    }
+}
+
+/* Takes ownership of dirname. May be called from any thread. */
+static void QueueDirectory(char* dirname)
+{
+    ScanResult* result = calloc(1, sizeof (ScanResult));
+
+    g_atomic_int_inc(&sOutstanding);
+    if (result) {
+        result->dirname = dirname;
+        result->files = g_ptr_array_new();
+        if (QueueWork(WORK_BACKGROUND, ScanOneDirectory, AddScanned, result))
+            return;
+        g_ptr_array_free(result->files, TRUE);
+        free(result);
+    }
+    fprintf(stderr, "Out of memory: can't scan %s\n", dirname);
+    g_free(dirname);
+    DirectoryDone();
+}
+
+/* Read one directory, queueing any subdirectories if we're recursive.
+ * Runs in a worker thread: it mustn't touch the image list.
+ */
+static void ScanOneDirectory(gpointer data, GCancellable* cancel)
+{
+    ScanResult* result = (ScanResult*)data;
+    char* dirname = result->dirname;
+    GDir* dir = g_dir_open(dirname, 0, NULL);
+    const gchar* name;
+    struct stat st;
+
+    if (!dir)
+        fprintf(stderr, "Can't read directory %s\n", dirname);
+    else {
+        while ((name = g_dir_read_name(dir)) != 0) {
+            char* path;
+
+            /* Skip hidden files, and things like .thumbnails */
+            if (name[0] == '.')
+                continue;
+            path = g_build_filename(dirname, name, NULL);
+
+            /* Don't follow links to directories: they can loop */
+            if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+                if (gScanRecursive) {
+                    QueueDirectory(path);
+                    continue;
+                }
+            }
+            else if (stat(path, &st) == 0 && S_ISREG(st.st_mode)
+                     && st.st_size > 0 && SniffImageFile(path)) {
+                g_ptr_array_add(result->files, path);
+                continue;
+            }
+            g_free(path);
+        }
+        g_dir_close(dir);
+    }
+
+    g_ptr_array_sort(result->files, CompareNames);
+}
+
+/* Called from the main loop with each directory's images */
+static void AddScanned(gpointer data)
+{
+    ScanResult* result = (ScanResult*)data;
+    int wasLast = (gCurImage && gCurImage->next == gFirstImage);
+    int i;
+
+    if (gDebug)
+        printf("Found %d images in %s\n", result->files->len,
+               result->dirname);
+
+    /* The PhoImages own the names now */
+    for (i = 0; i < result->files->len; ++i)
+        AddImage((char*)g_ptr_array_index(result->files, i));
+
+    if (result->files->len > 0) {
+        if (!gCurImage)    /* nothing showing yet: this is the first */
+            NextImage();
+        else if (wasLast)  /* there's a next image now */
+            PrefetchNeighbors();
+    }
+
+    g_ptr_array_free(result->files, FALSE);
+    g_free(result->dirname);
+    free(result);
+
+    DirectoryDone();
+}
+
+/* Scan dirname for images when StartScan() is called */
+void ScanDirectory(char* dirname)
+{
+    sDirsToScan = g_slist_append(sDirsToScan, g_strdup(dirname));
+}
+
+/* Start scanning the directories from ScanDirectory().
+ * Call once, after gtk_init().
+ */
+void StartScan()
+{
+    GSList* dirs = sDirsToScan;
+    GSList* d;
+
+    if (!dirs)
+        return;
+    sDirsToScan = 0;
+
+    FindImageLoaders();
+
+    for (d = dirs; d; d = d->next)
+        QueueDirectory((char*)d->data);
+    g_slist_free(dirs);
+}
+
+/* Are there directories that haven't been added to the list yet? */
+int ScanInProgress()
+{
+    return (sDirsToScan != 0 || g_atomic_int_get(&sOutstanding) > 0);
+}
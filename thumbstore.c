@@ -0,0 +1,278 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * thumbstore.c: read and write thumbnails in the shared freedesktop.org
+ * thumbnail cache, for pho, an image viewer.
+ *
+ * Copyright 2016 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+/* Thumbnails live in ~/.cache/thumbnails/normal (up to 128 pixels)
+ * and ~/.cache/thumbnails/large (up to 256), as PNGs named by the MD5
+ * of the file's URI, per the Thumbnail Managing Standard:
+ * http://specifications.freedesktop.org/thumbnail-spec/
+ * Each records the URI and modification time of the original, so a
+ * stale one can be recognized, and the size of the original.
+ * Other programs (file managers, gimp) read and write the same files,
+ * so a directory looked at once never needs decoding for thumbnails
+ * again.
+ *
+ * Like other thumbnailers, we store thumbnails already rotated to
+ * their EXIF orientation.
+ *
+ * Each thumbnail is written to a name of its own and renamed into
+ * place, so two threads (or programs) saving the same one don't
+ * trip over each other; apart from that it only reads gDebug.
+ */
+
+#include "pho.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+
+/* Find the URI, and the thumbnail path for size, for filename.
+ * Returns 0 if filename doesn't exist. Free both with g_free().
+ */
+static int ThumbnailPaths(char* filename, int size,
+                          gchar** uri, gchar** thumbpath)
+{
+    char abspath[PATH_MAX];
+    gchar* md5;
+    gchar* base;
+
+    /* The spec wants the absolute, canonical URI */
+    if (!realpath(filename, abspath))
+        return 0;
+    *uri = g_filename_to_uri(abspath, NULL, NULL);
+    if (!*uri)
+        return 0;
+
+    md5 = g_compute_checksum_for_string(G_CHECKSUM_MD5, *uri, -1);
+    base = g_strdup_printf("%s.png", md5);
+    *thumbpath = g_build_filename(g_get_user_cache_dir(), "thumbnails",
+                                  (size > THUMB_NORMAL ? "large" : "normal"),
+                                  base, NULL);
+    g_free(base);
+    g_free(md5);
+    return 1;
+}
+
+/* Get the stored thumbnail for filename, no bigger than size
+ * (THUMB_NORMAL or THUMB_LARGE), if there's one that's up to date.
+ * It's already rotated to the EXIF orientation.
+ * If the thumbnail records the size of the original, that goes in
+ * *trueWidth and *trueHeight (unrotated); otherwise they're set to 0.
+ * Returns a new pixbuf, or 0.
+ */
+GdkPixbuf* ThumbnailLoad(char* filename, int size,
+                         int* trueWidth, int* trueHeight)
+{
+    gchar* uri;
+    gchar* thumbpath;
+    GdkPixbuf* pix;
+    const gchar* opt;
+    struct stat st;
+
+    *trueWidth = *trueHeight = 0;
+
+    if (stat(filename, &st) != 0)
+        return 0;
+    if (!ThumbnailPaths(filename, size, &uri, &thumbpath))
+        return 0;
+
+    pix = gdk_pixbuf_new_from_file(thumbpath, NULL);
+    if (pix) {
+        /* It has to be for the same file, and the file mustn't
+         * have changed since.
+         */
+        opt = gdk_pixbuf_get_option(pix, "tEXt::Thumb::URI");
+        if (!opt || strcmp(opt, uri) != 0) {
+            g_object_unref(pix);
+            pix = 0;
+        }
+        else {
+            opt = gdk_pixbuf_get_option(pix, "tEXt::Thumb::MTime");
+            if (!opt || strtol(opt, 0, 10) != (long)st.st_mtime) {
+                g_object_unref(pix);
+                pix = 0;
+            }
+        }
+    }
+    if (pix) {
+        opt = gdk_pixbuf_get_option(pix, "tEXt::Thumb::Image::Width");
+        if (opt)
+            *trueWidth = atoi(opt);
+        opt = gdk_pixbuf_get_option(pix, "tEXt::Thumb::Image::Height");
+        if (opt)
+            *trueHeight = atoi(opt);
+        if (*trueWidth <= 0 || *trueHeight <= 0)
+            *trueWidth = *trueHeight = 0;
+    }
+
+    g_free(uri);
+    g_free(thumbpath);
+    return pix;
+}
+
+/* Longer text chunks than this aren't ours to check */
+#define MAX_TEXT_CHUNK 8192
+
+/* Is there an up-to-date stored thumbnail for filename, no bigger than
+ * size? Like ThumbnailLoad(), but it only reads the PNG's text chunks,
+ * which come before the image data, rather than decoding it.
+ */
+int ThumbnailUpToDate(char* filename, int size)
+{
+    gchar* uri;
+    gchar* thumbpath;
+    struct stat st;
+    unsigned char chunk[8];
+    FILE* fp;
+    int uriOK = 0, mtimeOK = 0;
+
+    if (stat(filename, &st) != 0)
+        return 0;
+    if (!ThumbnailPaths(filename, size, &uri, &thumbpath))
+        return 0;
+
+    fp = fopen(thumbpath, "rb");
+    if (fp && fread(chunk, 1, 8, fp) == 8
+        && !memcmp(chunk, "\211PNG\r\n\032\n", 8)) {
+        /* Each chunk: length, type, data, CRC */
+        while (fread(chunk, 1, 8, fp) == 8 && memcmp(chunk + 4, "IDAT", 4)) {
+            long len = ((long)chunk[0] << 24) | (chunk[1] << 16)
+                       | (chunk[2] << 8) | chunk[3];
+
+            if (!memcmp(chunk + 4, "tEXt", 4) && len < MAX_TEXT_CHUNK) {
+                char text[MAX_TEXT_CHUNK + 1];
+
+                if (fread(text, 1, len, fp) != len)
+                    break;
+                text[len] = '\0';
+                /* The keyword, a NUL, then the value */
+                if (strlen(text) < len) {
+                    char* value = text + strlen(text) + 1;
+                    if (!strcmp(text, "Thumb::URI"))
+                        uriOK = !strcmp(value, uri);
+                    else if (!strcmp(text, "Thumb::MTime"))
+                        mtimeOK = (strtol(value, 0, 10) == (long)st.st_mtime);
+                }
+                len = 0;
+            }
+            if (fseek(fp, len + 4, SEEK_CUR) != 0)
+                break;
+        }
+    }
+    if (fp)
+        fclose(fp);
+
+    g_free(uri);
+    g_free(thumbpath);
+    return uriOK && mtimeOK;
+}
+
+/* Write one thumbnail of pix, no bigger than size. */
+static void SaveOneThumbnail(char* filename, GdkPixbuf* pix, int size,
+                             int trueWidth, int trueHeight,
+                             struct stat* st)
+{
+    gchar* uri;
+    gchar* thumbpath;
+    gchar* dir;
+    gchar* tmppath;
+    GdkPixbuf* thumb;
+    char mtime[32], width[16], height[16];
+    int w = gdk_pixbuf_get_width(pix);
+    int h = gdk_pixbuf_get_height(pix);
+
+    if (!ThumbnailPaths(filename, size, &uri, &thumbpath))
+        return;
+
+    /* Fit it in size x size. Never scale up: if pix is small,
+     * the original was small too.
+     */
+    if (w > size || h > size) {
+        if (w > h) {
+            h = h * size / w;
+            w = size;
+        } else {
+            w = w * size / h;
+            h = size;
+        }
+        if (w < 1) w = 1;
+        if (h < 1) h = 1;
+        thumb = ScaleRotatePixbuf(pix, w, h, 0, RESAMPLE_BEST);
+    }
+    else
+        thumb = g_object_ref(pix);
+
+    dir = g_path_get_dirname(thumbpath);
+    if (thumb && gdk_pixbuf_get_width(thumb) > 0
+        && g_mkdir_with_parents(dir, 0700) == 0) {
+        GError* err = NULL;
+
+        snprintf(mtime, sizeof mtime, "%ld", (long)st->st_mtime);
+        snprintf(width, sizeof width, "%d", trueWidth);
+        snprintf(height, sizeof height, "%d", trueHeight);
+
+        /* Write it under another name and rename it, so nobody
+         * (including another of our own threads) sees half a file.
+         */
+        tmppath = g_strdup_printf("%s.pho-%d-%p", thumbpath,
+                                  (int)getpid(), (void*)g_thread_self());
+        if (gdk_pixbuf_save(thumb, tmppath, "png", &err,
+                            "tEXt::Thumb::URI", uri,
+                            "tEXt::Thumb::MTime", mtime,
+                            "tEXt::Thumb::Image::Width", width,
+                            "tEXt::Thumb::Image::Height", height,
+                            "tEXt::Software", "pho " VERSION,
+                            NULL)) {
+            g_chmod(tmppath, 0600);
+            if (g_rename(tmppath, thumbpath) != 0)
+                g_unlink(tmppath);
+        }
+        else {
+            if (gDebug)
+                printf("Couldn't save thumbnail %s: %s\n", thumbpath,
+                       err ? err->message : "unknown error");
+            if (err)
+                g_error_free(err);
+            g_unlink(tmppath);
+        }
+        g_free(tmppath);
+    }
+
+    if (thumb)
+        g_object_unref(thumb);
+    g_free(dir);
+    g_free(uri);
+    g_free(thumbpath);
+}
+
+/* Store thumbnails for filename, made from pix, which is the image
+ * (at any size bigger than a thumbnail) rotated to its EXIF orientation.
+ * trueWidth and trueHeight are the size of the unrotated original.
+ */
+void ThumbnailSave(char* filename, GdkPixbuf* pix,
+                   int trueWidth, int trueHeight)
+{
+    struct stat st;
+
+    if (!pix || stat(filename, &st) != 0)
+        return;
+
+    /* Don't bother saving thumbnails of the thumbnails */
+    if (strstr(filename, "/.cache/thumbnails/"))
+        return;
+
+    SaveOneThumbnail(filename, pix, THUMB_LARGE,
+                     trueWidth, trueHeight, &st);
+    SaveOneThumbnail(filename, pix, THUMB_NORMAL,
+                     trueWidth, trueHeight, &st);
+}
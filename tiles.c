@@ -0,0 +1,172 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * tiles.c: draw big images a piece at a time, for pho, an image viewer.
+ *
+ * Copyright 2016 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+/* In fullsize mode an image can be many times the size of the screen,
+ * and DrawImage used to push the whole pixbuf to the X server on
+ * every redraw -- including every motion event while dragging it
+ * around in presentation mode. Instead, only the part that's visible
+ * gets drawn, and an image that doesn't fit is cut into tiles which
+ * are rendered into server-side pixmaps as they come into view.
+ * Tiles are kept, up to MAX_TILE_BYTES, so panning back and forth
+ * only costs copies on the server.
+ *
+ * gdk-pixbuf can't decode just part of an image, so the whole pixbuf
+ * is still in memory; it's only the drawing that's tiled.
+ */
+
+#include "pho.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#define TILE_SIZE 256
+#define MAX_TILE_BYTES (64 * 1024 * 1024)
+#define MAX_TILES (MAX_TILE_BYTES / (TILE_SIZE * TILE_SIZE * 4))
+
+typedef struct {
+    int tx, ty;
+    GdkPixmap* pixmap;
+    GList* link;          /* in sTileLRU */
+} Tile;
+
+#define TILE_KEY(tx, ty) GINT_TO_POINTER(((tx) << 16) | (ty))
+
+static GHashTable* sTiles = 0;
+static GQueue sTileLRU = { 0, 0, 0 };    /* most recently used at the head */
+
+/* The pixbuf the tiles came from. We don't hold a reference (it may be
+ * huge), so we tag it with sTileSerial to be sure it's still the same
+ * one and not a new pixbuf that happens to have the same address.
+ */
+static GdkPixbuf* sTilePixbuf = 0;
+static int sTileSerial = 0;
+#define TILE_TAG "pho-tiles"
+
+static void FreeTile(Tile* tile)
+{
+    g_hash_table_remove(sTiles, TILE_KEY(tile->tx, tile->ty));
+    g_object_unref(tile->pixmap);
+    free(tile);
+}
+
+/* Throw away all the tiles. Call this if the pixels of the image
+ * being drawn change without it becoming a different pixbuf.
+ */
+void ForgetTiles()
+{
+    Tile* tile;
+
+    while ((tile = (Tile*)g_queue_pop_tail(&sTileLRU)) != 0)
+        FreeTile(tile);
+    sTilePixbuf = 0;
+}
+
+/* Get the pixmap for tile tx, ty of pix, rendering it if need be.
+ * A new pixmap holds garbage, and pixels with alpha get blended over
+ * what's there, so for those it's filled with bgGC first.
+ * Returns 0 if we couldn't make one.
+ */
+static GdkPixmap* GetTile(GdkDrawable* drawable, GdkGC* bgGC, GdkPixbuf* pix,
+                          int tx, int ty)
+{
+    Tile* tile = (Tile*)g_hash_table_lookup(sTiles, TILE_KEY(tx, ty));
+    int w, h;
+
+    if (tile) {
+        g_queue_unlink(&sTileLRU, tile->link);
+        g_queue_push_head_link(&sTileLRU, tile->link);
+        return tile->pixmap;
+    }
+
+    w = MIN(TILE_SIZE, gdk_pixbuf_get_width(pix) - tx * TILE_SIZE);
+    h = MIN(TILE_SIZE, gdk_pixbuf_get_height(pix) - ty * TILE_SIZE);
+
+    tile = calloc(1, sizeof (Tile));
+    if (!tile)
+        return 0;
+    tile->pixmap = gdk_pixmap_new(drawable, w, h, -1);
+    if (!tile->pixmap) {
+        free(tile);
+        return 0;
+    }
+    if (gdk_pixbuf_get_has_alpha(pix))
+        gdk_draw_rectangle(tile->pixmap, bgGC, TRUE, 0, 0, w, h);
+    gdk_draw_pixbuf(tile->pixmap, NULL, pix, tx * TILE_SIZE, ty * TILE_SIZE,
+                    0, 0, w, h, GDK_RGB_DITHER_NONE, 0, 0);
+    tile->tx = tx;
+    tile->ty = ty;
+
+    g_queue_push_head(&sTileLRU, tile);
+    tile->link = sTileLRU.head;
+    g_hash_table_insert(sTiles, TILE_KEY(tx, ty), tile);
+
+    while (sTileLRU.length > MAX_TILES)
+        FreeTile((Tile*)g_queue_pop_tail(&sTileLRU));
+
+    return tile->pixmap;
+}
+
+/* Draw pix onto drawable with its top left corner at dstX, dstY,
+ * but only the part of it that falls inside the visible rectangle
+ * visX, visY, visW x visH (in drawable coordinates).
+ * bgGC draws the background, for any transparent parts.
+ */
+void DrawPixbufVisible(GdkDrawable* drawable, GdkGC* gc, GdkGC* bgGC,
+                       GdkPixbuf* pix, int dstX, int dstY,
+                       int visX, int visY, int visW, int visH)
+{
+    int pixWidth = gdk_pixbuf_get_width(pix);
+    int pixHeight = gdk_pixbuf_get_height(pix);
+    int x0, y0, x1, y1, tx, ty;
+
+    /* The visible part, in pixbuf coordinates */
+    x0 = MAX(visX - dstX, 0);
+    y0 = MAX(visY - dstY, 0);
+    x1 = MIN(visX + visW - dstX, pixWidth);
+    y1 = MIN(visY + visH - dstY, pixHeight);
+    if (x1 <= x0 || y1 <= y0)
+        return;
+
+    /* If it all fits, it'll never be panned, so tiles won't help */
+    if (pixWidth <= visW && pixHeight <= visH) {
+        gdk_draw_pixbuf(drawable, gc, pix, x0, y0, dstX + x0, dstY + y0,
+                        x1 - x0, y1 - y0, GDK_RGB_DITHER_NONE, 0, 0);
+        return;
+    }
+
+    if (!sTiles)
+        sTiles = g_hash_table_new(g_direct_hash, g_direct_equal);
+    if (pix != sTilePixbuf
+        || g_object_get_data(G_OBJECT(pix), TILE_TAG)
+           != GINT_TO_POINTER(sTileSerial)) {
+        ForgetTiles();
+        sTilePixbuf = pix;
+        g_object_set_data(G_OBJECT(pix), TILE_TAG,
+                          GINT_TO_POINTER(++sTileSerial));
+    }
+
+    for (ty = y0 / TILE_SIZE; ty * TILE_SIZE < y1; ++ty)
+        for (tx = x0 / TILE_SIZE; tx * TILE_SIZE < x1; ++tx) {
+            GdkPixmap* tile = GetTile(drawable, bgGC, pix, tx, ty);
+
+            /* The visible part of this tile, in pixbuf coordinates */
+            int sx = MAX(x0, tx * TILE_SIZE);
+            int sy = MAX(y0, ty * TILE_SIZE);
+            int ex = MIN(x1, (tx+1) * TILE_SIZE);
+            int ey = MIN(y1, (ty+1) * TILE_SIZE);
+
+            if (tile)
+                gdk_draw_drawable(drawable, gc, tile,
+                                  sx - tx * TILE_SIZE, sy - ty * TILE_SIZE,
+                                  dstX + sx, dstY + sy, ex - sx, ey - sy);
+            else    /* out of server memory? Draw it the slow way */
+                gdk_draw_pixbuf(drawable, gc, pix, sx, sy,
+                                dstX + sx, dstY + sy, ex - sx, ey - sy,
+                                GDK_RGB_DITHER_NONE, 0, 0);
+        }
+}
@@ -0,0 +1,314 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * validate.c: weed out broken files in the background,
+ * for pho, an image viewer.
+ *
+ * Copyright 2016 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+/* A file that won't load costs a full, failed decode when the user
+ * reaches it, and a pause while NextImage() or PrevImage() goes on
+ * to the one after. So while the user is looking at pictures,
+ * background jobs look over the files ahead of them: empty files,
+ * files that aren't any image format we can load, and JPEGs and PNGs
+ * that have been cut short. Those are taken out of the list before the
+ * user ever gets to them.
+ *
+ * While it's there it notes each image's size from its header.
+ *
+ * It only reads the headers and the last few kilobytes of each file,
+ * so it's cheap, and it only has one small batch of files out at a
+ * time, at background priority, so it stays out of the way of the
+ * display and the prefetcher.
+ *
+ * The workers only ever see copies of filenames; the list itself is
+ * only touched from the main loop.
+ */
+
+#include "pho.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* How many files to check in one job */
+#define VALIDATE_BATCH 32
+
+/* How far from the end of a file to look for its end marker */
+#define TAIL_BYTES 4096
+
+typedef struct {
+    int n;
+    PhoImage* imgs[VALIDATE_BATCH];       /* main thread only */
+    char* filenames[VALIDATE_BATCH];
+    const char* problems[VALIDATE_BATCH];  /* 0 if it looks okay */
+    int widths[VALIDATE_BATCH], heights[VALIDATE_BATCH];  /* 0 if unknown */
+} ValidateBatch;
+
+static ValidateBatch* sBatch = 0;      /* the one being checked */
+static guint sIdleID = 0;
+static int sStarted = 0;
+
+/* Does the JPEG in data have everything up through its first scan,
+ * and an end-of-image marker after that?
+ */
+static const char* CheckJpeg(const unsigned char* data, gsize len)
+{
+    gsize pos = 2;        /* past the SOI marker */
+    gsize i, tail;
+    int haveFrame = 0;
+    int marker;
+    gsize seglen;
+
+    /* Walk the marker segments up to the start of the image data */
+    while (1) {
+        if (pos >= len)
+            return "truncated";
+        if (data[pos] != 0xff)
+            return "corrupt header";
+        while (pos < len && data[pos] == 0xff)    /* fill bytes */
+            ++pos;
+        if (pos >= len)
+            return "truncated";
+        marker = data[pos++];
+
+        /* Markers without a segment */
+        if (marker == 0xd8 || marker == 0x01
+            || (marker >= 0xd0 && marker <= 0xd7))
+            continue;
+        if (marker == 0xd9)
+            return "no image data";
+
+        if (pos + 2 > len)
+            return "truncated";
+        seglen = (data[pos] << 8) | data[pos+1];
+        if (seglen < 2 || pos + seglen > len)
+            return "truncated";
+
+        /* SOF0 through SOF15, except DHT, JPG and DAC */
+        if (marker >= 0xc0 && marker <= 0xcf
+            && marker != 0xc4 && marker != 0xc8 && marker != 0xcc)
+            haveFrame = 1;
+
+        pos += seglen;
+        if (marker == 0xda)    /* start of scan: image data follows */
+            break;
+    }
+    if (!haveFrame)
+        return "no frame header";
+
+    /* Nearly always the file ends with the EOI marker. */
+    tail = (len - pos > TAIL_BYTES ? len - TAIL_BYTES : pos);
+    for (i = len - 1; i > tail; --i)
+        if (data[i] == 0xd9 && data[i-1] == 0xff)
+            return 0;
+
+    /* But some cameras tack other things on after it (motion photos
+     * append a whole video). Inside the image data, 0xff is always
+     * followed by a 0 or a restart marker, so the first ff d9
+     * after the scan header is the real end.
+     */
+    for (i = pos; i + 1 < tail; ++i) {
+        const unsigned char* ff = memchr(data + i, 0xff, tail - i);
+        if (!ff)
+            break;
+        i = ff - data;
+        if (i + 1 < len && data[i+1] == 0xd9)
+            return 0;
+    }
+    return "truncated";
+}
+
+/* Does the PNG in data start with a header chunk and end
+ * with an IEND chunk?
+ */
+static const char* CheckPng(const unsigned char* data, gsize len)
+{
+    gsize i;
+
+    if (len < 8 + 8 + 13 || memcmp(data + 12, "IHDR", 4))
+        return "corrupt header";
+
+    for (i = len - 4; i > 8 && i + TAIL_BYTES > len; --i)
+        if (!memcmp(data + i, "IEND", 4))
+            return 0;
+    return "truncated";
+}
+
+/* Returns 0 if filename looks like an image we can load,
+ * otherwise what's wrong with it. Its size, if the header says,
+ * goes in *width and *height.
+ */
+static const char* CheckImageFile(char* filename, int* width, int* height)
+{
+    GMappedFile* map;
+    const unsigned char* data;
+    gsize len;
+    const char* problem = 0;
+
+    map = g_mapped_file_new(filename, FALSE, NULL);
+    if (!map)
+        return "can't read it";
+    data = (const unsigned char*)g_mapped_file_get_contents(map);
+    len = g_mapped_file_get_length(map);
+
+    if (len == 0 || !data)
+        problem = "empty file";
+    else if (!SniffImageData(data, len)
+             && !gdk_pixbuf_get_file_info(filename, NULL, NULL))
+        /* gdk-pixbuf can also go by the content type,
+         * so it gets the last word.
+         */
+        problem = "not an image";
+    else if (len >= 2 && data[0] == 0xff && data[1] == 0xd8)
+        problem = CheckJpeg(data, len);
+    else if (data[0] == 0x89 && !memcmp(data + 1, "PNG", 3))
+        problem = CheckPng(data, len);
+
+    if (!problem)
+        ProbeImageSize(data, len, width, height);
+
+    g_mapped_file_unref(map);
+    return problem;
+}
+
+/* Runs in a worker thread */
+static void ValidateFiles(gpointer data, GCancellable* cancel)
+{
+    ValidateBatch* batch = (ValidateBatch*)data;
+    int i;
+
+    for (i = 0; i < batch->n; ++i)
+        batch->problems[i] = CheckImageFile(batch->filenames[i],
+                                            batch->widths + i,
+                                            batch->heights + i);
+}
+
+static void FinishBatch(gpointer data);    /* forward */
+
+/* Collect up to VALIDATE_BATCH images nobody has looked at yet,
+ * starting from the current image and working forward, since that's
+ * where the user is headed. Returns 0 if they've all been looked at.
+ */
+static ValidateBatch* NextBatch()
+{
+    ValidateBatch* batch;
+    PhoImage* start = (gCurImage ? gCurImage : gFirstImage);
+    PhoImage* img = start;
+
+    if (!start)
+        return 0;
+
+    batch = calloc(1, sizeof (ValidateBatch));
+    do {
+        if (!img->validated) {
+            img->validated = 1;
+            batch->imgs[batch->n] = img;
+            batch->filenames[batch->n] = g_strdup(img->filename);
+            ++batch->n;
+        }
+        img = img->next;
+    } while (img != start && batch->n < VALIDATE_BATCH);
+
+    if (batch->n == 0) {
+        free(batch);
+        return 0;
+    }
+    return batch;
+}
+
+/* Queue the next batch, if the last one is done */
+static gboolean FeedValidator(gpointer data)
+{
+    sIdleID = 0;
+    if (sBatch)
+        return FALSE;
+
+    sBatch = NextBatch();
+    if (sBatch && !QueueWork(WORK_BACKGROUND, ValidateFiles, FinishBatch,
+                             sBatch)) {
+        /* Out of memory: leave these unchecked */
+        int i;
+        for (i = 0; i < sBatch->n; ++i)
+            g_free(sBatch->filenames[i]);
+        free(sBatch);
+        sBatch = 0;
+    }
+    return FALSE;
+}
+
+static void FeedSoon()
+{
+    if (sStarted && !sBatch && !sIdleID)
+        sIdleID = g_idle_add_full(G_PRIORITY_LOW, FeedValidator, 0, NULL);
+}
+
+/* Called from the main loop with the verdicts */
+static void FinishBatch(gpointer data)
+{
+    ValidateBatch* batch = (ValidateBatch*)data;
+    int i;
+
+    /* From here on, ValidateForget() mustn't touch this batch */
+    if (sBatch == batch)
+        sBatch = 0;
+
+    for (i = 0; i < batch->n; ++i) {
+        PhoImage* img = batch->imgs[i];
+
+        g_free(batch->filenames[i]);
+        if (!img)
+            continue;
+        if (!batch->problems[i]) {
+            if (batch->widths[i] > 0) {
+                img->fileWidth = batch->widths[i];
+                img->fileHeight = batch->heights[i];
+            }
+            continue;
+        }
+
+        /* If the user is already there, NextImage() or PrevImage()
+         * has found out the hard way, or it loaded after all.
+         */
+        if (img == gCurImage)
+            continue;
+
+        if (gDebug)
+            printf("Skipping '%s' (%s)\n", img->filename,
+                   batch->problems[i]);
+        DeleteItem(img);
+    }
+    free(batch);
+
+    FeedSoon();
+}
+
+/* Start looking over the list. Call after the first image is up. */
+void StartValidator()
+{
+    if (sStarted)
+        return;
+    sStarted = 1;
+
+    FindImageLoaders();
+    FeedSoon();
+}
+
+/* There are new images to look at */
+void ValidateListChanged()
+{
+    FeedSoon();
+}
+
+/* img is about to be freed */
+void ValidateForget(PhoImage* img)
+{
+    int i;
+
+    if (!sBatch)
+        return;
+    for (i = 0; i < sBatch->n; ++i)
+        if (sBatch->imgs[i] == img)
+            sBatch->imgs[i] = 0;
+}
@@ -0,0 +1,188 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * workers.c: one pool of threads for all of pho's background work.
+ *
+ * Copyright 2016 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+/* Prefetching, grid thumbnails, directory scanning and validation
+ * all used to start their own threads, and had no way of knowing
+ * that one of the others was busy with something more urgent.
+ * Now they all queue jobs here, each with a priority:
+ *
+ *   WORK_CURRENT     the image the user is waiting for
+ *   WORK_NEXT        the next image in the direction they're going
+ *   WORK_PREV        the one behind them
+ *   WORK_BACKGROUND  thumbnails, scanning, checking files
+ *
+ * Jobs are started in order of priority, and in the order they were
+ * queued within a priority. A job already running isn't interrupted
+ * for a more urgent one, but the pool has more than one thread, so
+ * the image the user is waiting for never waits for long.
+ *
+ * Each job gets a GCancellable, which CancelWork() fires: a job that
+ * hasn't started is skipped, and one that's decoding can pass it to
+ * LoadPixbufFromBuffer() and stop partway. Either way its done
+ * function is called from the main loop, once, so the owner can pick
+ * up the result or just free its data.
+ *
+ * Work the main thread is waiting on, like a big scale, can be split
+ * up among the workers that have nothing else to do: SpareWorkers()
+ * says how many that is, counting the cores as well as the threads.
+ * A worker's own job is its share, so from a worker it's always 0.
+ */
+
+#include "pho.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#define MIN_WORKERS 2    /* so a slow scan can't hold up the display */
+#define MAX_WORKERS 4
+
+struct WorkJob_s {
+    int priority;
+    guint seq;              /* order queued, within a priority */
+    WorkFunc func;
+    WorkDoneFunc done;
+    gpointer data;
+    GCancellable* cancel;
+};
+
+static GThreadPool* sPool = 0;
+static int sNoPool = 0;     /* couldn't start the threads, don't try again */
+static int sNumWorkers = 0;
+static gint sSeq = 0;
+static gint sBusy = 0;      /* workers running a job */
+
+/* Set in the worker threads */
+static GPrivate sInWorker = G_PRIVATE_INIT(NULL);
+
+static void FreeJob(WorkJob* job)
+{
+    g_object_unref(job->cancel);
+    free(job);
+}
+
+/* Called from the main loop when a job has finished or been skipped */
+static gboolean DeliverWork(gpointer data)
+{
+    WorkJob* job = (WorkJob*)data;
+
+    job->done(job->data);
+    FreeJob(job);
+    return FALSE;
+}
+
+/* user_data is set when it's the pool calling, rather than
+ * QueueWork() doing the job on the spot.
+ */
+static void RunJob(gpointer data, gpointer user_data)
+{
+    WorkJob* job = (WorkJob*)data;
+
+    if (user_data)
+        g_private_set(&sInWorker, GINT_TO_POINTER(1));
+
+    if (!g_cancellable_is_cancelled(job->cancel)) {
+        g_atomic_int_inc(&sBusy);
+        job->func(job->data, job->cancel);
+        g_atomic_int_add(&sBusy, -1);
+    }
+
+    if (!job->done)
+        FreeJob(job);
+    else
+        /* Background results can wait for the display to catch up */
+        g_idle_add_full((job->priority == WORK_BACKGROUND
+                         ? G_PRIORITY_LOW : G_PRIORITY_DEFAULT_IDLE),
+                        DeliverWork, job, NULL);
+}
+
+static gint CompareWork(gconstpointer a, gconstpointer b, gpointer data)
+{
+    const WorkJob* ja = (const WorkJob*)a;
+    const WorkJob* jb = (const WorkJob*)b;
+
+    if (ja->priority != jb->priority)
+        return ja->priority - jb->priority;
+    return (ja->seq < jb->seq) ? -1 : (ja->seq > jb->seq);
+}
+
+/* Start the threads, if they aren't already.
+ * Returns -1 if there aren't any, in which case QueueWork()
+ * will do each job on the spot.
+ */
+int StartWorkers()
+{
+    int nthreads;
+
+    if (sPool)
+        return 0;
+    if (sNoPool)
+        return -1;
+
+    nthreads = CLAMP((int)g_get_num_processors(), MIN_WORKERS, MAX_WORKERS);
+    sPool = g_thread_pool_new(RunJob, GINT_TO_POINTER(1), nthreads,
+                              FALSE, NULL);
+    if (!sPool) {
+        if (gDebug) printf("Couldn't start worker threads\n");
+        sNoPool = 1;
+        return -1;
+    }
+    g_thread_pool_set_sort_function(sPool, CompareWork, 0);
+    sNumWorkers = nthreads;
+    return 0;
+}
+
+/* How many more jobs the workers could start on right now, without
+ * any of them waiting and without more threads running than there are
+ * cores, counting the caller's. Always 0 from a worker thread, or if
+ * there are no workers.
+ */
+int SpareWorkers()
+{
+    int spare;
+
+    if (!sPool || g_private_get(&sInWorker))
+        return 0;
+    spare = MIN(sNumWorkers, (int)g_get_num_processors() - 1)
+            - g_atomic_int_get(&sBusy);
+    return MAX(spare, 0);
+}
+
+/* Have a worker thread call func(data, cancel), then call done(data)
+ * from the main loop. done may be 0 if there's nothing to clean up,
+ * but then the job is freed as soon as it's run, so the pointer
+ * returned mustn't be kept. May be called from any thread.
+ */
+WorkJob* QueueWork(int priority, WorkFunc func, WorkDoneFunc done,
+                   gpointer data)
+{
+    WorkJob* job = calloc(1, sizeof (WorkJob));
+    if (!job)
+        return 0;
+
+    job->priority = priority;
+    job->seq = (guint)g_atomic_int_add(&sSeq, 1);
+    job->func = func;
+    job->done = done;
+    job->data = data;
+    job->cancel = g_cancellable_new();
+
+    if (StartWorkers() == 0)
+        g_thread_pool_push(sPool, job, NULL);
+    else    /* no threads: slow, but it works */
+        RunJob(job, 0);
+    return job;
+}
+
+/* Tell job it isn't wanted any more. Only from the main loop,
+ * and only before its done function has been called.
+ */
+void CancelWork(WorkJob* job)
+{
+    if (job)
+        g_cancellable_cancel(job->cancel);
+}